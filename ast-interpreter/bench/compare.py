@@ -0,0 +1,149 @@
+#!/usr/bin/env python3
+"""Compare ast-interpreter against the same guest programs compiled natively.
+
+Every guest program is compiled with clang and linked with shim.c, which
+implements GET/MALLOC/FREE/PRINT. The native binary and the interpreter then
+run on the same GET inputs. The script checks that both exit with status 0
+and PRINT the same values, and reports the interpreter-to-native slowdown for
+each program. Process and clang front-end startup is measured once on an
+empty program, reported on its own and subtracted from every run, so the
+slowdown compares execution only. Each invocation appends one JSON line to
+the history file, so the slowdown can be tracked across engine changes.
+
+    bench/compare.py --interpreter build/bin/ast-interpreter test-cases/*.c
+"""
+import argparse
+import datetime
+import glob
+import json
+import math
+import os
+import re
+import subprocess
+import sys
+import tempfile
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+NUMBER = re.compile(r'^-?\d+$')
+EMPTY = 'int main() { return 0; }\n'
+
+
+def printed(stderr):
+    """PRINT output only: drop GET prompts and front-end diagnostics."""
+    return [line for line in stderr.decode(errors='replace').splitlines()
+            if NUMBER.match(line.strip())]
+
+
+def timed(cmd, stdin):
+    start = time.perf_counter()
+    proc = subprocess.run(cmd, input=stdin.encode(), stdout=subprocess.DEVNULL,
+                          stderr=subprocess.PIPE)
+    return time.perf_counter() - start, proc.returncode, printed(proc.stderr)
+
+
+def best(cmd, stdin, repeat):
+    """Fastest time, the first non-zero exit status (0 if none) and the output."""
+    runs = [timed(cmd, stdin) for _ in range(repeat)]
+    status = next((run[1] for run in runs if run[1] != 0), 0)
+    return min(run[0] for run in runs), status, runs[0][2]
+
+
+def compile_native(cc, source, workdir):
+    exe = os.path.join(workdir, os.path.basename(source) + '.native')
+    subprocess.run([cc, '-O2', '-w', '-x', 'c', source, '-x', 'c',
+                    os.path.join(HERE, 'shim.c'), '-o', exe], check=True)
+    return exe
+
+
+def git_revision():
+    try:
+        return subprocess.run(['git', 'rev-parse', '--short', 'HEAD'], cwd=HERE,
+                              stdout=subprocess.PIPE, stderr=subprocess.DEVNULL,
+                              check=True).stdout.decode().strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('programs', nargs='*',
+                        help='guest programs (default: test-cases/*.c)')
+    parser.add_argument('--interpreter', default='ast-interpreter')
+    parser.add_argument('--cc', default='clang')
+    parser.add_argument('--inputs', action='append',
+                        help='GET input set for programs that call GET, may be repeated '
+                             '(default: "7" and "-7")')
+    parser.add_argument('--repeat', type=int, default=3,
+                        help='runs per measurement, the fastest one counts')
+    parser.add_argument('--history', default=os.path.join(HERE, 'history.jsonl'),
+                        help='machine-readable results, one JSON line per invocation')
+    args = parser.parse_args()
+
+    programs = args.programs or sorted(glob.glob(os.path.join(HERE, '..', 'test-cases', '*.c')))
+    input_sets = args.inputs or ['7', '-7']
+
+    results = []
+    failed = False
+    with tempfile.TemporaryDirectory() as workdir:
+        empty = os.path.join(workdir, 'empty.c')
+        with open(empty, 'w') as f:
+            f.write(EMPTY)
+        native_startup = best([compile_native(args.cc, empty, workdir)], '', args.repeat)[0]
+        interp_startup = best([args.interpreter, EMPTY], '', args.repeat)[0]
+        print('startup      native %9.4fs  interpreter %9.4fs  (subtracted below)'
+              % (native_startup, interp_startup))
+
+        for program in programs:
+            with open(program) as f:
+                source = f.read()
+            name = os.path.basename(program)
+            try:
+                native = compile_native(args.cc, program, workdir)
+            except subprocess.CalledProcessError:
+                print('%-12s native build failed' % name)
+                failed = True
+                continue
+
+            inputs = input_sets if 'GET' in source else ['']
+            native_time = interp_time = 0.0
+            match = True
+            status = 0
+            for stdin in inputs:
+                t, native_status, expected = best([native], stdin, args.repeat)
+                native_time += max(t - native_startup, 0.0)
+                t, interp_status, actual = best([args.interpreter, source], stdin, args.repeat)
+                interp_time += max(t - interp_startup, 0.0)
+                if native_status or interp_status:
+                    status = status or interp_status or native_status
+                    print('%-12s input %r: native exited with %d, interpreter with %d'
+                          % (name, stdin, native_status, interp_status))
+                if actual != expected:
+                    match = False
+                    print('%-12s input %r: expected %s, got %s' % (name, stdin, expected, actual))
+
+            slowdown = interp_time / native_time if native_time > 0 else float('inf')
+            ok = match and status == 0
+            failed = failed or not ok
+            results.append({'program': name, 'match': match, 'status': status, 'native_s': native_time,
+                            'interpreter_s': interp_time, 'slowdown': slowdown})
+            print('%-12s %-4s native %9.4fs  interpreter %9.4fs  slowdown %8.1fx'
+                  % (name, 'ok' if ok else 'FAIL', native_time, interp_time, slowdown))
+
+    finite = [r['slowdown'] for r in results
+              if r['match'] and r['status'] == 0 and math.isfinite(r['slowdown']) and r['slowdown'] > 0]
+    geomean = math.exp(sum(math.log(s) for s in finite) / len(finite)) if finite else None
+    if geomean is not None:
+        print('geometric mean slowdown %.1fx over %d programs' % (geomean, len(finite)))
+
+    with open(args.history, 'a') as f:
+        f.write(json.dumps({'time': datetime.datetime.now().isoformat(timespec='seconds'),
+                            'revision': git_revision(), 'interpreter': args.interpreter,
+                            'native_startup_s': native_startup, 'interpreter_startup_s': interp_startup,
+                            'geomean_slowdown': geomean, 'programs': results}) + '\n')
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
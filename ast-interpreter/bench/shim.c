@@ -0,0 +1,23 @@
+/* Native implementation of the interpreter builtins, linked with a guest
+ * program to build the baseline that compare.py measures against.
+ * PRINT writes to stderr like the interpreter does, GET reads stdin. */
+#include <stdio.h>
+#include <stdlib.h>
+
+int GET() {
+	int val = 0;
+	if (scanf("%d", &val) != 1) val = 0;
+	return val;
+}
+
+void * MALLOC(int size) {
+	return malloc(size);
+}
+
+void FREE(void * ptr) {
+	free(ptr);
+}
+
+void PRINT(int val) {
+	fprintf(stderr, "%d\n", val);
+}
@@ -4,25 +4,159 @@
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendAction.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/ThreadPool.h"
+#include <atomic>
+#include <fstream>
 
 using namespace clang;
 using namespace std;
 
 #include "Environment.h"
+#include "Lanes.h"
+#include "Session.h"
+#include "Server.h"
+#include "ResultCache.h"
+
+static llvm::cl::opt<std::string> Source(llvm::cl::Positional,
+	llvm::cl::desc("<source code>"));
+
+static llvm::cl::list<std::string> ForkInputs("fork", llvm::cl::CommaSeparated,
+	llvm::cl::value_desc("file,..."),
+	llvm::cl::desc("Snapshot the interpreter and finish the run once per input file"));
+
+static llvm::cl::opt<Snapshot::Point> SnapshotAt("snapshot-at",
+	llvm::cl::desc("Where -fork snapshots the interpreter"),
+	llvm::cl::values(
+		clEnumValN(Snapshot::AfterInit, "init", "after global initialization"),
+		clEnumValN(Snapshot::FirstGet, "get", "at the first GET")),
+	llvm::cl::init(Snapshot::FirstGet));
+
+static llvm::cl::list<std::string> AsyncInputs("async", llvm::cl::CommaSeparated,
+	llvm::cl::value_desc("pipe,..."),
+	llvm::cl::desc("Run the program once per input pipe, all sessions on one thread"));
+
+static llvm::cl::list<std::string> LaneInputs("lanes", llvm::cl::CommaSeparated,
+	llvm::cl::value_desc("file,..."),
+	llvm::cl::desc("Run the program over every input file in lockstep, output to <file>.out"));
+
+static llvm::cl::opt<unsigned> LaneDivergence("lanes-divergence",
+	llvm::cl::desc("Divergent conditions a lane may sit out before it is rerun on its own, 0 never"),
+	llvm::cl::init(16));
+
+static llvm::cl::list<std::string> LinkFiles("link", llvm::cl::CommaSeparated,
+	llvm::cl::value_desc("file.c,..."),
+	llvm::cl::desc("Parse the files in parallel and link them into one program"));
+
+static llvm::cl::opt<std::string> CacheDir("cache",
+	llvm::cl::desc("Cache whole runs by source and GET input in the directory"),
+	llvm::cl::value_desc("dir"));
+
+static llvm::cl::opt<unsigned> CacheSize("cache-size",
+	llvm::cl::desc("MiB the -cache directory may hold"), llvm::cl::init(256));
+
+static llvm::cl::opt<std::string> RecordFile("record",
+	llvm::cl::desc("Record the source, GET values and MALLOC results of the run to the file"),
+	llvm::cl::value_desc("file"));
+
+static llvm::cl::opt<std::string> ReplayFile("replay",
+	llvm::cl::desc("Rerun a -record trace without stdin and check it does the same"),
+	llvm::cl::value_desc("file"));
+
+static llvm::cl::opt<bool> Serve("serve",
+	llvm::cl::desc("Serve programs on a Unix socket, see ast-interpreter-client"));
+
+static llvm::cl::opt<std::string> SocketPath("socket",
+	llvm::cl::desc("Socket used by -serve"), llvm::cl::value_desc("path"),
+	llvm::cl::init("/tmp/ast-interpreter.sock"));
+
+static llvm::cl::opt<std::string> ProfileFile("profile",
+	llvm::cl::desc("Sample the guest call stack and write folded stacks to the file"),
+	llvm::cl::value_desc("file"));
+
+static llvm::cl::opt<unsigned> ProfileHz("profile-hz",
+	llvm::cl::desc("Samples per second of CPU time taken by -profile"),
+	llvm::cl::init(99));
+
+static llvm::cl::opt<bool> Counters("perf-counters",
+	llvm::cl::desc("Count cycles, instructions, branch and cache misses per guest function"));
+
+/// Stop the profiler and write what it sampled to -profile
+static void writeProfile(Profiler * profiler) {
+	profiler->stop();
+	std::ofstream out(ProfileFile.c_str());
+	if (!out) {
+		llvm::errs() << "cannot write profile " << ProfileFile << "\n";
+		return;
+	}
+	profiler->write(out);
+}
+
+static llvm::cl::opt<unsigned> InlineSize("inline-size",
+	llvm::cl::desc("Inline calls to functions of at most this many AST nodes, 0 disables inlining"),
+	llvm::cl::init(80));
+
+static llvm::cl::opt<unsigned> InlineDepth("inline-depth",
+	llvm::cl::desc("Deepest nesting of inlined calls in one frame"), llvm::cl::init(3));
+
+static llvm::cl::opt<bool> InlineReport("inline-report",
+	llvm::cl::desc("List the call sites that were and were not inlined"));
+
+static llvm::cl::opt<bool> Collect("gc",
+	llvm::cl::desc("Collect unreachable guest memory (conservative mark-sweep)"));
+
+static llvm::cl::opt<unsigned> GcThreshold("gc-threshold",
+	llvm::cl::desc("KiB allocated between collections"), llvm::cl::init(65536));
+
+static llvm::cl::opt<bool> GcReport("gc-report",
+	llvm::cl::desc("Report every collection and the totals at exit"));
+
+static llvm::cl::opt<bool> Checked("checked",
+	llvm::cl::desc("Check every guest memory access against its allocation"));
+
+/// Settings every Environment of the tool shares
+static void configure(Environment & env) {
+	env.setChecked(Checked);
+	env.setInlining(InlineSize, InlineDepth);
+	if (Collect) env.setCollector(std::max(1L, (long)GcThreshold * 1024), GcReport);
+}
+
+/// Where a plain run reads GET and writes PRINT, when not stdin and stderr
+static InputSource * RunInput = NULL;
+static llvm::raw_ostream * RunOutput = NULL;
+/// Where the end-of-run reports go, when not stderr
+static llvm::raw_ostream * RunReport = NULL;
+/// Set when a run ended on a bad guest memory access, the exit status is 1
+static bool RunFailed = false;
+static Trace * RunTrace = NULL;
+
 //#define DEBUG 1
-class InterpreterVisitor : 
-   	public EvaluatedExprVisitor<InterpreterVisitor> {
+/// The visitor drives an Env: Environment for ordinary runs, LaneEnvironment
+/// for -lanes
+template <class Env>
+class BasicInterpreterVisitor : 
+   	public EvaluatedExprVisitor<BasicInterpreterVisitor<Env> > {
 public:
-	explicit InterpreterVisitor(const ASTContext &context, Environment * env)
-	: EvaluatedExprVisitor(context), mEnv(env) {}
-	virtual ~InterpreterVisitor() {}
+	explicit BasicInterpreterVisitor(const ASTContext &context, Env * env)
+	: EvaluatedExprVisitor<BasicInterpreterVisitor>(context), mEnv(env) {
+		mEnv->setRunner(&BasicInterpreterVisitor::run);
+	}
+	virtual ~BasicInterpreterVisitor() {}
+
+	/// Run a function body on a visitor of its own, used for guest threads
+	static void run(Env * env, FunctionDecl * fn) {
+		BasicInterpreterVisitor visitor(fn->getASTContext(), env);
+		visitor.VisitStmt(fn->getBody());
+	}
 
 	virtual void VisitBinaryOperator (BinaryOperator * bop) {
 		#ifdef DEBUG
 			std::cout<<"Enter BOP"<<std::endl;
 		#endif
 		if(mEnv->isReturn()) return;
-		VisitStmt(bop);
+		this->VisitStmt(bop);
+		if(mEnv->isReturn()) return;
 		mEnv->binop(bop);
    	}
 
@@ -32,7 +166,8 @@ public:
 			std::cout<<"Enter UOP"<<std::endl;
 		#endif
 		if(mEnv->isReturn()) return;
-		VisitStmt(uop);
+		this->VisitStmt(uop);
+		if(mEnv->isReturn()) return;
 		mEnv->unaryop(uop);
    }
 
@@ -41,7 +176,7 @@ public:
 			std::cout<<"Enter DeclRefExpr"<<std::endl;
 		#endif
 		if(mEnv->isReturn()) return;
-		VisitStmt(expr);
+		this->VisitStmt(expr);
 		mEnv->declref(expr);
 		#ifdef DEBUG
 			std::cout<<"Leave DeclRefExpr"<<std::endl;
@@ -53,7 +188,8 @@ public:
 			std::cout<<"Enter CAST"<<std::endl;
 		#endif
 		if(mEnv->isReturn()) return;
-		VisitStmt(expr);
+		this->VisitStmt(expr);
+		if(mEnv->isReturn()) return;
 		mEnv->cast(expr);
    }
 
@@ -62,12 +198,15 @@ public:
 			std::cout<<"Enter CALL"<<std::endl;
 		#endif
 		if(mEnv->isReturn()) return;
-		VisitStmt(call);
-		mEnv->call(call);
-		FunctionDecl * callee = call->getDirectCallee();
-		if(callee->hasBody()){                                                
-        	VisitStmt(callee->getBody());
-			mEnv->setReturn();
+		this->VisitStmt(call);
+		if(mEnv->isReturn()) return;
+		if(FunctionInfo * inlined = mEnv->inlined(call)){
+			runInline(call, inlined);
+			return;
+		}
+		if(FunctionDecl * callee = mEnv->call(call)){
+        	this->VisitStmt(callee->getBody());
+			mEnv->leave(call);
        	}
 	}
 
@@ -94,7 +233,8 @@ public:
 			std::cout<<"Enter ArraySubscriptExpr"<<std::endl;
 		#endif
 		if(mEnv->isReturn()) return;
-		VisitStmt(arrayexpr);
+		this->VisitStmt(arrayexpr);
+		if(mEnv->isReturn()) return;
 		mEnv->array(arrayexpr);
    }
 
@@ -104,7 +244,7 @@ public:
 		#endif
 		if(mEnv->isReturn()) return;
 		Expr *expr=ifstmt->getCond();
-		Visit(expr);
+		this->Visit(expr);
 		bool cond=mEnv->getcond(expr);
 		if(cond){
 			if(isa<BinaryOperator>(ifstmt->getThen())){
@@ -116,7 +256,7 @@ public:
 				this->VisitReturnStmt(ret);	
 			}
 			else{
-                VisitStmt(ifstmt->getThen());
+                this->VisitStmt(ifstmt->getThen());
             }
 		}
 		else{
@@ -131,7 +271,7 @@ public:
 				
 				}
 				else{
-					VisitStmt(ifstmt->getElse());
+					this->VisitStmt(ifstmt->getElse());
         		}
     		}
    	}
@@ -142,15 +282,15 @@ public:
 		#endif
 		if(mEnv->isReturn()) return;
 		Expr *expr = whilestmt->getCond();
-		Visit(expr);
+		this->Visit(expr);
 		bool cond=mEnv->getcond(expr);
 		Stmt *body=whilestmt->getBody();
 		while(cond){
 			if( body && isa<CompoundStmt>(body) ){
-				VisitStmt(whilestmt->getBody());
+				this->VisitStmt(whilestmt->getBody());
 			}
         	//update the condition value
-			Visit(expr);
+			this->Visit(expr);
 			cond=mEnv->getcond(expr);
       }
    }   
@@ -170,16 +310,16 @@ public:
 				this->VisitBinaryOperator(bop);
 			}
        	 	else{
-            	VisitStmt(stmt);
+            	this->VisitStmt(stmt);
 			}
 		}
         Expr* expr = forstmt->getCond();
-        Visit(expr);
+        this->Visit(expr);
         bool cond=mEnv->getcond(expr);
         Stmt* body=forstmt->getBody();
         while(cond){
             if(body && isa<CompoundStmt>(body) ){
-                VisitStmt(body);
+                this->VisitStmt(body);
             }
             Stmt* stmt=forstmt->getInc();
             if(isa<BinaryOperator>(stmt)){
@@ -187,9 +327,9 @@ public:
                 this->VisitBinaryOperator(bop);
             }
             else{
-                VisitStmt(stmt);
+                this->VisitStmt(stmt);
             }
-            Visit(expr);
+            this->Visit(expr);
             cond=mEnv->getcond(expr);
         }
 
@@ -204,26 +344,110 @@ public:
 		#ifdef DEBUG
 			std::cout<<"enter ret"<<endl;
         #endif
-		VisitStmt(retstmt);
+		this->VisitStmt(retstmt);
+		if(mEnv->isReturn()) return;
 		mEnv->ret(retstmt);
 		mEnv->setReturn();
 	}
 	
 	virtual void VisitUnaryExprOrTypeTraitExpr(UnaryExprOrTypeTraitExpr* type){
 		if(mEnv->isReturn()) return;
-		VisitStmt(type);
+		this->VisitStmt(type);
 		mEnv->typetrait(type);
 	}
 	
 	virtual void VisitParenExpr(ParenExpr* paren){
 		if(mEnv->isReturn()) return;
-		VisitStmt(paren);
+		this->VisitStmt(paren);
+		if(mEnv->isReturn()) return;
 		mEnv->paren(paren);
 	}
 private:
-   Environment * mEnv;
+	/// Run an inlined callee in the current frame: no frame is pushed and
+	/// no return statement runs, the value of the guard or final return
+	/// that applies becomes the value of the call
+	void runInline(CallExpr * call, FunctionInfo * callee) {
+		mEnv->enterInline(call, callee);
+		for (Stmt * stmt : callee->Prologue)
+			this->Visit(stmt);
+		Expr * result = callee->Result;
+		for (auto & guard : callee->Guards) {
+			this->Visit(guard.first);
+			if (mEnv->getcond(guard.first)) {
+				result = guard.second;
+				break;
+			}
+		}
+		if (result) this->Visit(result);
+		mEnv->leaveInline(call, result);
+	}
+
+   Env * mEnv;
 };
 
+typedef BasicInterpreterVisitor<Environment> InterpreterVisitor;
+
+/// -lanes: a condition may hold in some lanes only. The then branch or the
+/// loop body runs once for the lanes where it holds, with the others masked
+/// off, the else branch once for the rest, and every lane that did not
+/// return is live again after the statement.
+template <>
+void BasicInterpreterVisitor<LaneEnvironment>::VisitIfStmt(IfStmt * ifstmt) {
+	if(mEnv->isReturn()) return;
+	Expr * expr = ifstmt->getCond();
+	this->Visit(expr);
+	if(mEnv->isReturn()) return;
+	LaneEnvironment::Mask mask = mEnv->mask();
+	mEnv->narrow(expr);
+	this->Visit(ifstmt->getThen());
+	if(ifstmt->getElse()){
+		mEnv->otherwise(mask, expr);
+		this->Visit(ifstmt->getElse());
+	}
+	mEnv->restore(mask);
+}
+
+template <>
+void BasicInterpreterVisitor<LaneEnvironment>::VisitWhileStmt(WhileStmt * whilestmt) {
+	if(mEnv->isReturn()) return;
+	LaneEnvironment::Mask mask = mEnv->mask();
+	Expr * expr = whilestmt->getCond();
+	Stmt * body = whilestmt->getBody();
+	this->Visit(expr);
+	mEnv->narrow(expr);
+	while(!mEnv->isReturn()){
+		if(body && isa<CompoundStmt>(body))
+			this->VisitStmt(body);
+		this->Visit(expr);
+		mEnv->narrow(expr);
+	}
+	mEnv->restore(mask);
+}
+
+template <>
+void BasicInterpreterVisitor<LaneEnvironment>::VisitForStmt(ForStmt * forstmt) {
+	if(mEnv->isReturn()) return;
+	LaneEnvironment::Mask mask = mEnv->mask();
+	if(Stmt * init = forstmt->getInit()){
+		if(isa<BinaryOperator>(init)) this->Visit(init);
+		else this->VisitStmt(init);
+	}
+	Expr * expr = forstmt->getCond();
+	Stmt * body = forstmt->getBody();
+	this->Visit(expr);
+	mEnv->narrow(expr);
+	while(!mEnv->isReturn()){
+		if(body && isa<CompoundStmt>(body))
+			this->VisitStmt(body);
+		Stmt * inc = forstmt->getInc();
+		if(isa<BinaryOperator>(inc)) this->Visit(inc);
+		else this->VisitStmt(inc);
+		this->Visit(expr);
+		mEnv->narrow(expr);
+	}
+	mEnv->restore(mask);
+}
+
 class InterpreterConsumer : public ASTConsumer {
 public:
    explicit InterpreterConsumer(const ASTContext& context) : mEnv(),
@@ -233,14 +457,137 @@ public:
 
    virtual void HandleTranslationUnit(clang::ASTContext &Context) {
 	   TranslationUnitDecl * decl = Context.getTranslationUnitDecl();
+	   if (!AsyncInputs.empty()) {
+		   runSessions(Context, decl);
+		   return;
+	   }
+	   if (!LaneInputs.empty()) {
+		   runLanes(Context, decl);
+		   return;
+	   }
+	   if (!ProfileFile.empty()) {
+		   mProfiler.reset(new Profiler(ProfileHz));
+		   mEnv.setProfiler(mProfiler.get());
+	   }
+	   if (Counters) {
+		   mCounters.reset(new PerfCounters());
+		   mEnv.setCounters(mCounters.get());
+	   }
+	   configure(mEnv);
+	   if (RunInput) mEnv.setInput(RunInput);
+	   if (RunOutput) mEnv.setOutput(RunOutput);
+	   if (RunTrace) mEnv.setTrace(RunTrace);
 	   mEnv.init(decl);
 
+	   if (!ForkInputs.empty()) {
+		   mSnapshot.reset(new Snapshot(std::vector<std::string>(ForkInputs.begin(), ForkInputs.end())));
+		   if (SnapshotAt == Snapshot::AfterInit) mSnapshot->take();
+		   else mEnv.setSnapshot(mSnapshot.get());
+	   }
+
 	   FunctionDecl * entry = mEnv.getEntry();
+	   if (mProfiler) mProfiler->start();
 	   mVisitor.VisitStmt(entry->getBody());
+	   if (mProfiler) writeProfile(mProfiler.get());
+	   llvm::raw_ostream & report = RunReport ? *RunReport : llvm::errs();
+	   if (InlineReport) mEnv.reportInlining(report);
+	   if (Collect && GcReport) mEnv.reportCollector(report);
+	   if (Checked) mEnv.reportChecks(report);
+	   if (mCounters) mCounters->report(report);
+	   if (mEnv.failed()) RunFailed = true;
   }
 private:
+   /// Host one session per -async input on a single thread. A session
+   /// waiting in GET is parked until its pipe becomes readable; outputs are
+   /// printed in input order once every session has finished.
+   void runSessions(ASTContext &Context, TranslationUnitDecl * unit) {
+	   SessionLoop loop;
+	   std::vector<std::string> outputs(AsyncInputs.size());
+	   for (unsigned i = 0; i < AsyncInputs.size(); ++i) {
+		   int fd = open(AsyncInputs[i].c_str(), O_RDONLY | O_NONBLOCK);
+		   if (fd < 0) {
+			   llvm::errs() << "cannot open input " << AsyncInputs[i] << "\n";
+			   continue;
+		   }
+		   std::string * out = &outputs[i];
+		   Session * session = new Session(&loop, fd, [&Context, unit, out](Session * session) {
+			   llvm::raw_string_ostream os(*out);
+			   Environment env;
+			   env.setInput(session);
+			   env.setOutput(&os);
+			   env.setSession();
+			   configure(env);
+			   env.init(unit);
+			   InterpreterVisitor visitor(Context, &env);
+			   visitor.VisitStmt(env.getEntry()->getBody());
+			   if (env.failed()) RunFailed = true;
+		   });
+		   session->onFinish([](Session * session) {
+			   int fd = session->getFd();
+			   delete session;
+			   close(fd);
+		   });
+		   loop.add(session);
+	   }
+	   loop.run();
+
+	   for (unsigned i = 0; i < outputs.size(); ++i)
+		   llvm::errs() << outputs[i];
+   }
+
+   /// The first option given that the lanes would ignore, or NULL
+   static const char * laneConflict() {
+	   if (Checked) return "-checked";
+	   if (Collect) return "-gc";
+	   if (InlineSize.getNumOccurrences() || InlineDepth.getNumOccurrences()) return "-inline-size and -inline-depth";
+	   if (InlineReport) return "-inline-report";
+	   if (!ProfileFile.empty()) return "-profile";
+	   if (Counters) return "-perf-counters";
+	   if (!CacheDir.empty()) return "-cache";
+	   if (!RecordFile.empty() || !ReplayFile.empty()) return "-record and -replay";
+	   return NULL;
+   }
+
+   /// -lanes: one walk of the program for all inputs, see LaneEnvironment.
+   /// The lanes that diverged too far are rerun one by one afterwards.
+   void runLanes(ASTContext &Context, TranslationUnitDecl * unit) {
+	   if (const char * option = laneConflict()) {
+		   llvm::errs() << "-lanes does not support " << option << "\n";
+		   RunFailed = true;
+		   return;
+	   }
+	   LaneEnvironment env(std::vector<std::string>(LaneInputs.begin(), LaneInputs.end()));
+	   if (!env.hasLanes()) {
+		   llvm::errs() << "-lanes: no input could be opened\n";
+		   RunFailed = true;
+		   return;
+	   }
+	   env.setDivergence(LaneDivergence);
+	   env.init(unit);
+	   if (!env.getEntry()) return;
+	   BasicInterpreterVisitor<LaneEnvironment> visitor(Context, &env);
+	   visitor.VisitStmt(env.getEntry()->getBody());
+	   for (unsigned lane : env.getPeeled()) {
+		   FileInput in(env.restart(lane));
+		   std::string output;
+		   llvm::raw_string_ostream os(output);
+		   Environment scalar;
+		   scalar.setInput(&in);
+		   scalar.setOutput(&os);
+		   scalar.init(unit);
+		   InterpreterVisitor rerun(Context, &scalar);
+		   rerun.VisitStmt(scalar.getEntry()->getBody());
+		   env.setOutput(lane, os.str());
+		   if (scalar.failed()) RunFailed = true;
+	   }
+	   env.finish();
+   }
+
    Environment mEnv;
    InterpreterVisitor mVisitor;
+   std::unique_ptr<Snapshot> mSnapshot;
+   std::unique_ptr<Profiler> mProfiler;
+   std::unique_ptr<PerfCounters> mCounters;
 };
 
 class InterpreterClassAction : public ASTFrontendAction {
@@ -252,9 +599,227 @@ public:
   }
 };
 
+/// -serve: one long-lived process keeps LLVM initialized and the recently
+/// parsed programs cached, and runs every connection as a session. Replies
+/// are framed, see readRequest; a client that hangs up only ends its own
+/// session.
+static int serve() {
+   signal(SIGPIPE, SIG_IGN);
+   SessionLoop loop;
+   UnitCache units(64);
+   Server server(&loop, SocketPath, [&loop, &units](int fd) {
+	   Session * session = new Session(&loop, fd, [&units](Session * session) {
+		   std::string source, errors;
+		   if (!readRequest(session, source)) return;
+		   std::shared_ptr<ASTUnit> unit = units.get(source, errors);
+		   if (!unit) {
+			   writeFrame(session, 'e', errors);
+			   writeFrame(session, 's', "1");
+			   return;
+		   }
+
+		   Reply reply(session);
+		   ReplyInput input(session, reply);
+		   Environment env;
+		   env.setInput(&input);
+		   env.setOutput(&reply);
+		   env.setSession();
+		   configure(env);
+		   env.init(unit->getASTContext().getTranslationUnitDecl());
+		   if (env.getEntry()) {
+			   InterpreterVisitor visitor(unit->getASTContext(), &env);
+			   visitor.VisitStmt(env.getEntry()->getBody());
+		   }
+		   if (reply.failed()) {
+			   llvm::errs() << "-serve: client went away, output of its run dropped\n";
+			   return;
+		   }
+		   writeFrame(session, 's', env.getEntry() && !env.failed() ? "0" : "1");
+	   });
+	   session->onFinish([](Session * session) {
+		   int fd = session->getFd();
+		   delete session;
+		   close(fd);
+	   });
+	   loop.add(session);
+   });
+   if (!server.listen()) return 1;
+   loop.run();
+   return 0;
+}
+
+/// -link: parse every file as its own ASTUnit on a thread pool, then link
+/// the units into one Environment and run main. Files are parsed as C++,
+/// like the single source on the command line (input.cc).
+static int runLinked() {
+   std::vector<std::unique_ptr<ASTUnit> > units(LinkFiles.size());
+   std::atomic<bool> failed(false);
+   {
+	   llvm::ThreadPool pool;
+	   for (unsigned i = 0; i < LinkFiles.size(); ++i) {
+		   std::string file = LinkFiles[i];
+		   pool.async([&units, &failed, i, file]() {
+			   llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer> > buffer = llvm::MemoryBuffer::getFile(file);
+			   if (buffer)
+				   units[i] = clang::tooling::buildASTFromCodeWithArgs((*buffer)->getBuffer(),
+					   std::vector<std::string>{"-x", "c++"}, file);
+			   if (!units[i] || units[i]->getDiagnostics().hasErrorOccurred()) {
+				   llvm::errs() << "cannot parse " << file << "\n";
+				   failed = true;
+			   }
+		   });
+	   }
+	   pool.wait();
+   }
+   if (failed) return 1;
+
+   std::unique_ptr<Profiler> profiler;
+   Environment env;
+   configure(env);
+   if (!ProfileFile.empty()) {
+	   profiler.reset(new Profiler(ProfileHz));
+	   env.setProfiler(profiler.get());
+   }
+   std::unique_ptr<PerfCounters> counters;
+   if (Counters) {
+	   counters.reset(new PerfCounters());
+	   env.setCounters(counters.get());
+   }
+   bool linked = true;
+   for (unsigned i = 0; i < units.size(); ++i)
+	   linked = env.link(units[i]->getASTContext().getTranslationUnitDecl()) && linked;
+   if (!linked) return 1;
+   FunctionDecl * entry = env.getEntry();
+   if (!entry) {
+	   llvm::errs() << "no main in the linked files\n";
+	   return 1;
+   }
+   env.start();
+   InterpreterVisitor visitor(entry->getASTContext(), &env);
+   if (profiler) profiler->start();
+   visitor.VisitStmt(entry->getBody());
+   if (profiler) writeProfile(profiler.get());
+   if (InlineReport) env.reportInlining(llvm::errs());
+   if (Collect && GcReport) env.reportCollector(llvm::errs());
+   if (Checked) env.reportChecks(llvm::errs());
+   if (counters) counters->report(llvm::errs());
+   return env.failed() ? 1 : 0;
+}
+
+/// The options that change what a run prints, part of the -cache key
+static std::string cacheOptions() {
+   return "checked=" + std::to_string((int)Checked) + " gc=" + std::to_string((int)Collect)
+	   + " gc-threshold=" + std::to_string((unsigned)GcThreshold) + " inline-size=" + std::to_string((unsigned)InlineSize)
+	   + " inline-depth=" + std::to_string((unsigned)InlineDepth) + " inline-report=" + std::to_string((int)InlineReport);
+}
+
+/// -cache: the whole GET input is read up front and, with the source and
+/// the options, looked up in the cache. A hit prints the stored output and
+/// reports without running the front end; a miss runs the program on the
+/// buffered input and stores what it printed and its exit status. Runs the
+/// front end rejects are not stored. Profiles, counters and collector
+/// reports measure the run itself, so runs asking for them bypass the cache.
+static int runCached() {
+   if (!ProfileFile.empty() || Counters || GcReport) {
+	   llvm::errs() << "-cache is ignored with -profile, -perf-counters and -gc-report\n";
+	   clang::tooling::runToolOnCode(new InterpreterClassAction, Source);
+	   return RunFailed ? 1 : 0;
+   }
+   std::string input((std::istreambuf_iterator<char>(std::cin)), std::istreambuf_iterator<char>());
+   ResultCache cache(CacheDir, (long)CacheSize << 20);
+   std::string key = ResultCache::key(Source, input, cacheOptions());
+   int status = 0;
+   std::string output;
+   if (cache.get(key, status, output)) {
+	   llvm::errs() << output;
+	   return status;
+   }
+
+   llvm::raw_string_ostream os(output);
+   StringInput in(input, os);
+   RunInput = &in;
+   RunOutput = &os;
+   RunReport = &os;
+   bool parsed = clang::tooling::runToolOnCode(new InterpreterClassAction, Source);
+   RunInput = NULL;
+   RunOutput = NULL;
+   RunReport = NULL;
+   os.flush();
+   llvm::errs() << output;
+   status = parsed && !RunFailed ? 0 : 1;
+   if (parsed) cache.put(key, status, output);
+   return status;
+}
+
+/// -record: an ordinary interactive run that also writes its trace. A run
+/// the front end rejects writes none.
+static int runRecorded() {
+   Trace trace(Source);
+   StdinInput stdinInput;
+   TraceInput in(&stdinInput, trace);
+   TraceOutput out(trace, &llvm::errs());
+   RunInput = &in;
+   RunOutput = &out;
+   RunTrace = &trace;
+   bool parsed = clang::tooling::runToolOnCode(new InterpreterClassAction, Source);
+   RunInput = NULL;
+   RunOutput = NULL;
+   RunTrace = NULL;
+   out.flush();
+   if (parsed && !trace.write(RecordFile)) {
+	   llvm::errs() << "cannot write trace " << RecordFile << "\n";
+	   return 1;
+   }
+   return parsed && !RunFailed ? 0 : 1;
+}
+
+/// -replay: rerun a trace with GET fed from it and PRINT discarded, then
+/// report whether every GET, MALLOC and the output matched, and the time
+/// the run took
+static int runReplay() {
+   Trace trace;
+   if (!trace.load(ReplayFile)) {
+	   llvm::errs() << "cannot read trace " << ReplayFile << "\n";
+	   return 1;
+   }
+   TraceInput in(NULL, trace);
+   TraceOutput out(trace, NULL);
+   RunInput = &in;
+   RunOutput = &out;
+   RunTrace = &trace;
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+   bool ok = clang::tooling::runToolOnCode(new InterpreterClassAction, trace.getSource());
+   double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+   RunInput = NULL;
+   RunOutput = NULL;
+   RunTrace = NULL;
+   out.flush();
+   if (!ok) {
+	   llvm::errs() << "replay: the recorded source no longer compiles\n";
+	   return 1;
+   }
+   llvm::errs() << llvm::format("replay: %.3f ms\n", ms);
+   return trace.verify(llvm::errs()) ? 0 : 1;
+}
+
 int main (int argc, char ** argv) {
-   if (argc > 1) {
-       clang::tooling::runToolOnCode(new InterpreterClassAction, argv[1]);
+   llvm::cl::ParseCommandLineOptions(argc, argv, "AST interpreter\n");
+   if (Serve) {
+       return serve();
+   }
+   if (!LinkFiles.empty()) {
+       return runLinked();
+   }
+   if (!ReplayFile.empty()) {
+       return runReplay();
+   }
+   if (!Source.empty()) {
+       if (!RecordFile.empty())
+           return runRecorded();
+       if (!CacheDir.empty() && ForkInputs.empty() && AsyncInputs.empty() && LaneInputs.empty())
+           return runCached();
+       clang::tooling::runToolOnCode(new InterpreterClassAction, Source);
    }
+   return RunFailed ? 1 : 0;
 }
 
@@ -0,0 +1,271 @@
+//==--- Bounds.h - Guest accesses proven in bounds ahead of time ---------===//
+//===----------------------------------------------------------------------===//
+#include "llvm/ADT/DenseSet.h"
+
+/// BoundsAnalysis finds the memory accesses of a function that checked mode
+/// does not need to check at run time: a[i], *p and *(p + k) where
+///  - the base is a local array of constant size, or a local pointer that
+///    is only ever set to MALLOC of one constant size, earlier in the body;
+///  - the base does not escape, so nothing else can FREE its block;
+///  - the index is a constant, or the induction variable of an enclosing
+///    counted loop `for (i = c0; i < c1; i = i + 1)` that the body does not
+///    write, and every value it takes is in range.
+/// Sizes follow the interpreter: an allocation of n bytes holds n / size
+/// elements of size bytes, a char taking 1 byte and everything else 4.
+class BoundsAnalysis {
+	llvm::DenseSet<Stmt *> & mProven;
+	llvm::DenseMap<VarDecl *, long> mExtents;	/// Bytes behind each usable base
+	llvm::DenseMap<VarDecl *, std::pair<long, long> > mRanges;	/// Induction variables in scope
+	llvm::DenseMap<VarDecl *, long> mMallocs;	/// Pointers only set to MALLOC of this many bytes
+	llvm::DenseSet<VarDecl *> mEscaped;
+	llvm::DenseSet<DeclRefExpr *> mBaseRefs;	/// References that are a base or a MALLOC assignment
+	Stmt * mBody;
+
+	static VarDecl * var(Expr * expr) {
+		DeclRefExpr * ref = expr ? dyn_cast<DeclRefExpr>(expr->IgnoreParenImpCasts()) : NULL;
+		VarDecl * vardecl = ref ? dyn_cast<VarDecl>(ref->getDecl()) : NULL;
+		return vardecl && vardecl->isLocalVarDecl() && vardecl->hasLocalStorage() ? vardecl : NULL;
+	}
+
+	static long elementSize(QualType type) {
+		return type->isCharType() ? sizeof(char) : sizeof(int);
+	}
+
+	/// Fold a constant the way the interpreter would evaluate it
+	static bool constant(Expr * expr, long & val) {
+		expr = expr->IgnoreParenCasts();
+		if (IntegerLiteral * integer = dyn_cast<IntegerLiteral>(expr)) {
+			val = integer->getValue().getSExtValue();
+			return true;
+		}
+		if (UnaryExprOrTypeTraitExpr * type = dyn_cast<UnaryExprOrTypeTraitExpr>(expr)) {
+			val = elementSize(type->getTypeOfArgument());
+			return true;
+		}
+		if (UnaryOperator * uop = dyn_cast<UnaryOperator>(expr)) {
+			if (uop->getOpcode() != UO_Minus || !constant(uop->getSubExpr(), val)) return false;
+			val = -val;
+			return true;
+		}
+		long left = 0, right = 0;
+		BinaryOperator * bop = dyn_cast<BinaryOperator>(expr);
+		if (!bop || !constant(bop->getLHS(), left) || !constant(bop->getRHS(), right)) return false;
+		switch (bop->getOpcode()) {
+			case BO_Add: val = left + right; return true;
+			case BO_Sub: val = left - right; return true;
+			case BO_Mul: val = left * right; return true;
+			default: return false;
+		}
+	}
+
+	/// Bytes of MALLOC(constant), -1 for anything else
+	static long malloced(Expr * expr) {
+		CallExpr * call = dyn_cast<CallExpr>(expr->IgnoreParenCasts());
+		FunctionDecl * callee = call ? call->getDirectCallee() : NULL;
+		long bytes = 0;
+		if (!callee || !callee->getName().equals("MALLOC") || call->getNumArgs() != 1 ||
+				!constant(call->getArg(0), bytes) || bytes < 0)
+			return -1;
+		return bytes;
+	}
+
+	/// Split the operand of a deref into base and constant element offset.
+	/// p + k is the address p + k, which the heap rounds up to a word.
+	static VarDecl * based(Expr * expr, long & offset) {
+		offset = 0;
+		expr = expr->IgnoreParenImpCasts();
+		if (BinaryOperator * bop = dyn_cast<BinaryOperator>(expr)) {
+			if (bop->getOpcode() != BO_Add || !constant(bop->getRHS(), offset)) return NULL;
+			offset = ((offset + 3) & ~3L) / 4;
+			expr = bop->getLHS();
+		}
+		return var(expr);
+	}
+
+	static DeclRefExpr * ref(Expr * expr) {
+		BinaryOperator * bop = dyn_cast<BinaryOperator>(expr->IgnoreParenImpCasts());
+		if (bop && bop->getOpcode() == BO_Add) expr = bop->getLHS();
+		return dyn_cast<DeclRefExpr>(expr->IgnoreParenImpCasts());
+	}
+
+	/// Whether stmt, apart from skip, writes var or takes its address
+	static bool writes(Stmt * stmt, VarDecl * vardecl, Stmt * skip = NULL) {
+		if (!stmt || stmt == skip) return false;
+		if (BinaryOperator * bop = dyn_cast<BinaryOperator>(stmt))
+			if (bop->isAssignmentOp() && var(bop->getLHS()) == vardecl) return true;
+		if (UnaryOperator * uop = dyn_cast<UnaryOperator>(stmt))
+			if ((uop->isIncrementDecrementOp() || uop->getOpcode() == UO_AddrOf) && var(uop->getSubExpr()) == vardecl)
+				return true;
+		for (Stmt * child : stmt->children())
+			if (writes(child, vardecl, skip)) return true;
+		return false;
+	}
+
+	/// Match `for (i = c0; i < c1; i = i + 1)` or `i <= c1`, with `i++` allowed
+	/// too. Without an init, `int i = c0;` must be the only other write of i
+	/// in the function.
+	bool counted(ForStmt * loop, VarDecl * & vardecl, long & lo, long & hi) {
+		BinaryOperator * cond = dyn_cast_or_null<BinaryOperator>(loop->getCond());
+		if (!cond || (cond->getOpcode() != BO_LT && cond->getOpcode() != BO_LE)) return false;
+		vardecl = var(cond->getLHS());
+		if (!vardecl || !constant(cond->getRHS(), hi)) return false;
+		if (cond->getOpcode() == BO_LT) --hi;
+
+		Stmt * init = loop->getInit();
+		if (BinaryOperator * bop = dyn_cast_or_null<BinaryOperator>(init)) {
+			if (bop->getOpcode() != BO_Assign || var(bop->getLHS()) != vardecl || !constant(bop->getRHS(), lo)) return false;
+		}
+		else if (DeclStmt * declstmt = dyn_cast_or_null<DeclStmt>(init)) {
+			if (!declstmt->isSingleDecl() || declstmt->getSingleDecl() != vardecl || !vardecl->hasInit() ||
+					!constant(vardecl->getInit(), lo))
+				return false;
+		}
+		else if (init || !vardecl->hasInit() || !constant(vardecl->getInit(), lo) ||
+				writes(mBody, vardecl, loop->getInc()))
+			return false;
+
+		Expr * inc = dyn_cast_or_null<Expr>(loop->getInc());
+		if (!inc) return false;
+		inc = inc->IgnoreParens();
+		if (UnaryOperator * uop = dyn_cast<UnaryOperator>(inc)) {
+			if (!uop->isIncrementOp() || var(uop->getSubExpr()) != vardecl) return false;
+		}
+		else {
+			BinaryOperator * bop = dyn_cast<BinaryOperator>(inc);
+			BinaryOperator * add = bop ? dyn_cast<BinaryOperator>(bop->getRHS()->IgnoreParenImpCasts()) : NULL;
+			long step = 0;
+			if (!bop || bop->getOpcode() != BO_Assign || var(bop->getLHS()) != vardecl || !add ||
+					add->getOpcode() != BO_Add || var(add->getLHS()) != vardecl || !constant(add->getRHS(), step) || step != 1)
+				return false;
+		}
+		return !writes(loop->getBody(), vardecl) && !writes(loop->getCond(), vardecl);
+	}
+
+	/// Whether index stays in [0, n) for n elements behind base
+	bool inBounds(VarDecl * base, Expr * index, long offset, long size) {
+		llvm::DenseMap<VarDecl *, long>::iterator extent = mExtents.find(base);
+		if (extent == mExtents.end() || mEscaped.count(base)) return false;
+		long lo = 0, hi = 0;
+		if (!index) lo = hi = 0;
+		else if (!constant(index, lo)) {
+			llvm::DenseMap<VarDecl *, std::pair<long, long> >::iterator range = mRanges.find(var(index));
+			if (!var(index) || range == mRanges.end()) return false;
+			lo = range->second.first;
+			hi = range->second.second;
+		}
+		else hi = lo;
+		return lo + offset >= 0 && hi + offset < extent->second / size;
+	}
+
+	/// Record which references of each local may let its block escape
+	void uses(Stmt * stmt) {
+		if (!stmt) return;
+		if (ArraySubscriptExpr * array = dyn_cast<ArraySubscriptExpr>(stmt)) {
+			if (DeclRefExpr * base = dyn_cast<DeclRefExpr>(array->getBase()->IgnoreParenImpCasts())) mBaseRefs.insert(base);
+		}
+		else if (UnaryOperator * uop = dyn_cast<UnaryOperator>(stmt)) {
+			if (uop->getOpcode() == UO_Deref)
+				if (DeclRefExpr * base = ref(uop->getSubExpr())) mBaseRefs.insert(base);
+		}
+		else if (BinaryOperator * bop = dyn_cast<BinaryOperator>(stmt)) {
+			if (VarDecl * vardecl = var(bop->getLHS())) {
+				if (bop->isAssignmentOp() && vardecl->getType()->isPointerType()) {
+					long bytes = bop->getOpcode() == BO_Assign ? malloced(bop->getRHS()) : -1;
+					malloc(vardecl, bytes);
+					mBaseRefs.insert(dyn_cast<DeclRefExpr>(bop->getLHS()->IgnoreParenImpCasts()));
+				}
+			}
+		}
+		else if (DeclStmt * declstmt = dyn_cast<DeclStmt>(stmt)) {
+			for (DeclStmt::decl_iterator it = declstmt->decl_begin(), ie = declstmt->decl_end(); it != ie; ++it) {
+				VarDecl * vardecl = dyn_cast<VarDecl>(*it);
+				if (vardecl && vardecl->getType()->isPointerType() && vardecl->hasInit())
+					malloc(vardecl, malloced(vardecl->getInit()));
+			}
+		}
+		else if (DeclRefExpr * declref = dyn_cast<DeclRefExpr>(stmt)) {
+			VarDecl * vardecl = dyn_cast<VarDecl>(declref->getDecl());
+			if (vardecl && !mBaseRefs.count(declref)) mEscaped.insert(vardecl);
+		}
+		for (Stmt * child : stmt->children())
+			uses(child);
+	}
+
+	void malloc(VarDecl * vardecl, long bytes) {
+		llvm::DenseMap<VarDecl *, long>::iterator it = mMallocs.find(vardecl);
+		if (it == mMallocs.end()) mMallocs[vardecl] = bytes;
+		else if (it->second != bytes) it->second = -1;
+	}
+
+	/// Whether a top-level statement is the first MALLOC assignment of a pointer
+	VarDecl * assigns(Stmt * stmt) {
+		VarDecl * vardecl = NULL;
+		if (BinaryOperator * bop = dyn_cast<BinaryOperator>(stmt)) {
+			if (bop->getOpcode() == BO_Assign) vardecl = var(bop->getLHS());
+		}
+		else if (DeclStmt * declstmt = dyn_cast<DeclStmt>(stmt)) {
+			if (declstmt->isSingleDecl()) vardecl = dyn_cast<VarDecl>(declstmt->getSingleDecl());
+			if (vardecl && !vardecl->hasInit()) vardecl = NULL;
+		}
+		return vardecl && mMallocs.lookup(vardecl) > 0 ? vardecl : NULL;
+	}
+
+	void walk(Stmt * stmt) {
+		if (!stmt) return;
+		if (ForStmt * loop = dyn_cast<ForStmt>(stmt)) {
+			walk(loop->getInit());
+			walk(loop->getCond());
+			walk(loop->getInc());
+			VarDecl * vardecl = NULL;
+			long lo = 0, hi = 0;
+			if (counted(loop, vardecl, lo, hi) && !mRanges.count(vardecl)) {
+				mRanges[vardecl] = std::make_pair(lo, hi);
+				walk(loop->getBody());
+				mRanges.erase(vardecl);
+			}
+			else walk(loop->getBody());
+			return;
+		}
+		if (ArraySubscriptExpr * array = dyn_cast<ArraySubscriptExpr>(stmt)) {
+			VarDecl * base = var(array->getBase());
+			if (base && inBounds(base, array->getIdx(), 0, elementSize(array->getType())))
+				mProven.insert(array);
+		}
+		if (UnaryOperator * uop = dyn_cast<UnaryOperator>(stmt)) {
+			long offset = 0;
+			VarDecl * base = uop->getOpcode() == UO_Deref ? based(uop->getSubExpr(), offset) : NULL;
+			if (base && inBounds(base, NULL, offset, elementSize(uop->getType())))
+				mProven.insert(uop);
+		}
+		for (Stmt * child : stmt->children())
+			walk(child);
+	}
+
+public:
+	explicit BoundsAnalysis(llvm::DenseSet<Stmt *> & proven) : mProven(proven), mExtents(), mRanges(), mMallocs(),
+		mEscaped(), mBaseRefs(), mBody(NULL) {
+	}
+
+	/// Add the accesses of fn that are proven in bounds
+	void run(FunctionDecl * fn) {
+		CompoundStmt * body = dyn_cast_or_null<CompoundStmt>(fn->getBody());
+		if (!body) return;
+		mBody = body;
+		uses(body);
+		/// Walk the top-level statements in order: a MALLOCed pointer is a
+		/// usable base after the statement that first assigns it
+		for (CompoundStmt::body_iterator it = body->body_begin(), ie = body->body_end(); it != ie; ++it) {
+			if (DeclStmt * declstmt = dyn_cast<DeclStmt>(*it)) {
+				for (DeclStmt::decl_iterator d = declstmt->decl_begin(), de = declstmt->decl_end(); d != de; ++d) {
+					VarDecl * vardecl = dyn_cast<VarDecl>(*d);
+					if (!vardecl) continue;
+					if (const ConstantArrayType * array = dyn_cast_or_null<ConstantArrayType>(vardecl->getType()->getAsArrayTypeUnsafe()))
+						mExtents[vardecl] = array->getSize().getSExtValue() * elementSize(array->getElementType());
+				}
+			}
+			walk(*it);
+			if (VarDecl * vardecl = assigns(*it))
+				mExtents[vardecl] = mMallocs.lookup(vardecl);
+		}
+	}
+};
@@ -0,0 +1,49 @@
+//==--- Bulk.h - Native kernels behind the bulk-memory builtins ----------===//
+//===----------------------------------------------------------------------===//
+#include <algorithm>
+#include <string.h>
+
+/// The kernels work on the slot arrays of the heap, one long per guest
+/// element, after the caller has checked the whole range once. They are
+/// plain counted loops without early exits where possible, which the
+/// optimizer turns into SIMD code.
+namespace bulk {
+
+inline void fill(long * dst, long val, long n) {
+	for (long i = 0; i < n; ++i)
+		dst[i] = val;
+}
+
+inline void copy(long * dst, const long * src, long n) {
+	memmove(dst, src, n * sizeof(long));
+}
+
+/// -1, 0 or 1 like memcmp, comparing elements as ints
+inline long compare(const long * a, const long * b, long n) {
+	if (memcmp(a, b, n * sizeof(long)) == 0) return 0;
+	for (long i = 0; i < n; ++i)
+		if (a[i] != b[i]) return (int)a[i] < (int)b[i] ? -1 : 1;
+	return 0;
+}
+
+inline long sum(const long * src, long n) {
+	long total = 0;
+	for (long i = 0; i < n; ++i)
+		total += src[i];
+	return total;
+}
+
+inline long max(const long * src, long n) {
+	long best = src[0];
+	for (long i = 1; i < n; ++i)
+		best = std::max(best, src[i]);
+	return best;
+}
+
+/// dst[i] = start + i
+inline void range(long * dst, long start, long n) {
+	for (long i = 0; i < n; ++i)
+		dst[i] = (int)(start + i);
+}
+
+}
@@ -0,0 +1,167 @@
+//==--- Counters.h - Hardware performance counters per guest function ----===//
+//===----------------------------------------------------------------------===//
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "llvm/Support/Format.h"
+
+/// PerfCounters reads a group of perf events at every guest call and return
+/// and charges the difference to the guest function, inclusive and exclusive
+/// of its callees. Wall time is always measured; the hardware events are
+/// those the kernel lets us open, and none at all when perf_event_open is
+/// unavailable. Only the thread that runs main is counted.
+class PerfCounters {
+public:
+	enum Counter { Time, Cycles, Instructions, BranchMisses, L1Misses, LLCMisses, NumCounters };
+private:
+	typedef unsigned long long Sample[NumCounters];
+	struct Totals {
+		unsigned long Calls;
+		unsigned Active;		/// Activations on the stack, inclusive counts only the outermost
+		Sample Inclusive;
+		Sample Exclusive;
+	};
+	struct Frame {
+		FunctionDecl * Fn;
+		Sample Start;
+		Sample Callees;
+	};
+
+	int mFds[NumCounters];			/// -1 for Time and for events that did not open
+	unsigned mIndex[NumCounters];	/// Position of each event in a group read
+	int mLeader;
+	unsigned mOpened;
+	unsigned long long mRunning;	/// Time the group was scheduled, from the last read
+
+	std::vector<Frame> mStack;
+	llvm::DenseMap<FunctionDecl *, Totals> mTotals;
+
+	static int open(unsigned type, unsigned long long config, int group) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.disabled = group < 0;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+		return syscall(__NR_perf_event_open, &attr, 0, -1, group, 0);
+	}
+
+	static unsigned long long cache(unsigned long long id) {
+		return id | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	}
+
+	void sample(Sample & sample) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		sample[Time] = now.tv_sec * 1000000000ULL + now.tv_nsec;
+		for (unsigned i = Cycles; i < NumCounters; ++i)
+			sample[i] = 0;
+		if (mLeader < 0) return;
+
+		/// nr, time enabled, time running, then one value per event
+		unsigned long long values[3 + NumCounters];
+		if (read(mLeader, values, sizeof(values)) < (ssize_t)(3 * sizeof(values[0]))) return;
+		mRunning = values[2];
+		for (unsigned i = Cycles; i < NumCounters; ++i)
+			if (mFds[i] >= 0) sample[i] = values[3 + mIndex[i]];
+	}
+
+	static const char * name(unsigned counter) {
+		static const char * names[NumCounters] = { "time us", "cycles", "instructions", "branch misses", "L1D misses", "LLC misses" };
+		return names[counter];
+	}
+
+public:
+	PerfCounters() : mLeader(-1), mOpened(0), mRunning(0), mStack(), mTotals() {
+		struct { unsigned Type; unsigned long long Config; } events[NumCounters] = {
+			{ 0, 0 },
+			{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+			{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+			{ PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+			{ PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_L1D) },
+			{ PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_LL) },
+		};
+		mFds[Time] = -1;
+		for (unsigned i = Cycles; i < NumCounters; ++i) {
+			mFds[i] = open(events[i].Type, events[i].Config, mLeader);
+			if (mFds[i] < 0) continue;
+			if (mLeader < 0) mLeader = mFds[i];
+			mIndex[i] = mOpened++;
+		}
+		if (mLeader >= 0) ioctl(mLeader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		else llvm::errs() << "perf events unavailable, timing only\n";
+	}
+	~PerfCounters() {
+		for (unsigned i = Cycles; i < NumCounters; ++i)
+			if (mFds[i] >= 0) close(mFds[i]);
+	}
+
+	/// Called by the Environment when a guest function is entered and left
+	void enter(FunctionDecl * fn) {
+		mStack.push_back(Frame());
+		Frame & frame = mStack.back();
+		frame.Fn = fn;
+		memset(frame.Callees, 0, sizeof(frame.Callees));
+		Totals & totals = mTotals[fn];
+		++totals.Calls;
+		++totals.Active;
+		sample(frame.Start);
+	}
+
+	void leave() {
+		if (mStack.empty()) return;
+		Sample now;
+		sample(now);
+		Frame & frame = mStack.back();
+		Totals & totals = mTotals[frame.Fn];
+		--totals.Active;
+		Sample spent;
+		for (unsigned i = 0; i < NumCounters; ++i) {
+			spent[i] = now[i] - frame.Start[i];
+			totals.Exclusive[i] += spent[i] - frame.Callees[i];
+			if (!totals.Active) totals.Inclusive[i] += spent[i];
+		}
+		mStack.pop_back();
+		if (!mStack.empty())
+			for (unsigned i = 0; i < NumCounters; ++i)
+				mStack.back().Callees[i] += spent[i];
+	}
+
+	/// A table of every function called, most exclusive time first. Frames
+	/// still open, such as a main that did not return, are closed first.
+	void report(llvm::raw_ostream & os) {
+		while (!mStack.empty()) leave();
+
+		std::vector<std::pair<FunctionDecl *, Totals *> > rows;
+		for (llvm::DenseMap<FunctionDecl *, Totals>::iterator it = mTotals.begin(), ie = mTotals.end(); it != ie; ++it)
+			rows.push_back(std::make_pair(it->first, &it->second));
+		std::sort(rows.begin(), rows.end(), [](const std::pair<FunctionDecl *, Totals *> & a, const std::pair<FunctionDecl *, Totals *> & b) {
+			return a.second->Exclusive[Time] > b.second->Exclusive[Time];
+		});
+
+		os << llvm::format("%-20s %10s", (const char *)"function", (const char *)"calls");
+		for (unsigned i = 0; i < NumCounters; ++i)
+			if (i == Time || mFds[i] >= 0) os << llvm::format(" %27s", (std::string(name(i)) + " incl/excl").c_str());
+		os << "\n";
+		for (unsigned r = 0; r < rows.size(); ++r) {
+			Totals & totals = *rows[r].second;
+			os << llvm::format("%-20s %10lu", rows[r].first->getNameAsString().c_str(), totals.Calls);
+			for (unsigned i = 0; i < NumCounters; ++i) {
+				unsigned long long scale = i == Time ? 1000 : 1;
+				if (i == Time || mFds[i] >= 0)
+					os << llvm::format(" %13llu/%13llu", totals.Inclusive[i] / scale, totals.Exclusive[i] / scale);
+			}
+			os << "\n";
+		}
+		if (mLeader >= 0 && !mRunning)
+			os << "perf events were never scheduled, only the times are meaningful\n";
+	}
+};
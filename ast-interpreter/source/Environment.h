@@ -10,36 +10,103 @@
 #include "clang/Tooling/Tooling.h"
 #include <iostream>
 
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringMap.h"
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <sys/mman.h>
+
+#include "Snapshot.h"
+#include "Bulk.h"
+
 using namespace clang;
 using namespace std;
 
+#include "Profiler.h"
+#include "Bounds.h"
+#include "Counters.h"
+#include "Trace.h"
+
 //#define DEBUG 1
 
+/// What the interpreter precomputes for a function. It is prepared on the
+/// first call and cached, so functions that never run cost nothing.
+struct FunctionInfo {
+	/// The bulk-memory builtins come last, from MemSet on
+	enum BuiltinKind { None, Get, Print, Malloc, Free, Spawn, Join, AtomicAdd, AtomicCas, Barrier,
+		MemSet, MemCpy, MemCmp, SumInt, MaxInt, FillRange };
+	BuiltinKind Builtin;
+	FunctionDecl * Def;							/// Definition to run, NULL for builtins and externals
+	llvm::DenseMap<VarDecl *, long> ArraySizes;	/// Bytes to allocate for each local array
+
+	/// An inlinable function runs in the frame of its caller: the prologue,
+	/// which has no return, then the `if (c) return e;` guards in order,
+	/// then the final return
+	enum InlineState { Unknown, Inlinable, NotInlinable };
+	InlineState Inline;
+	const char * NoInline;						/// Why it is not inlinable
+	std::vector<Stmt *> Prologue;
+	std::vector<std::pair<Expr *, Expr *> > Guards;	/// (condition, returned value or NULL)
+	Expr * Result;								/// Value of the final return, NULL if none
+
+	FunctionInfo() : Builtin(None), Def(NULL), ArraySizes(), Inline(Unknown), NoInline(NULL),
+		Prologue(), Guards(), Result(NULL) {
+	}
+};
+
 class StackFrame {
    /// StackFrame maps Variable Declaration to Value
    /// Which are either integer or addresses (also represented using an long value)
-   std::map<Decl*, long> mVars;
-   std::map<Stmt*, long> mExprs;
+   /// Frames are pooled by the Environment. A frame is reset by bumping mGen
+   /// rather than by clearing its tables, so entries of the previous
+   /// activation become invalid while their buckets stay allocated for reuse.
+   struct Slot {
+      unsigned Gen;
+      long Val;
+   };
+   llvm::DenseMap<Decl*, Slot> mVars;
+   llvm::DenseMap<Stmt*, Slot> mExprs;
+   unsigned mGen;
+   /// The function running in this frame
+   FunctionInfo * mFunction;
    /// The current stmt
    Stmt * mPC;
    
 public:
-   StackFrame() : mVars(), mExprs(), mPC() {
+   StackFrame() : mVars(), mExprs(), mGen(0), mFunction(NULL), mPC() {
+   }
+
+   void reset(FunctionInfo * function) {
+      ++mGen;
+      mFunction = function;
+      mPC = NULL;
+   }
+
+   FunctionInfo * getFunction() {
+      return mFunction;
    }
 
    void bindDecl(Decl* decl, long val) {
-      mVars[decl] = val;
+      Slot & slot = mVars[decl];
+      slot.Gen = mGen;
+      slot.Val = val;
    }    
-   int getDeclVal(Decl * decl) {
-      assert (mVars.find(decl) != mVars.end());
-      return mVars.find(decl)->second;
+   long getDeclVal(Decl * decl) {
+      llvm::DenseMap<Decl*, Slot>::iterator it = mVars.find(decl);
+      assert (it != mVars.end() && it->second.Gen == mGen);
+      return it->second.Val;
    }
    void bindStmt(Stmt * stmt, long val) {
-	   mExprs[stmt] = val;
+	   Slot & slot = mExprs[stmt];
+	   slot.Gen = mGen;
+	   slot.Val = val;
    }
-   int getStmtVal(Stmt * stmt) {
-	   assert (mExprs.find(stmt) != mExprs.end());
-	   return mExprs[stmt];
+   long getStmtVal(Stmt * stmt) {
+	   llvm::DenseMap<Stmt*, Slot>::iterator it = mExprs.find(stmt);
+	   assert (it != mExprs.end() && it->second.Gen == mGen);
+	   return it->second.Val;
    }
    void setPC(Stmt * stmt) {
 	   mPC = stmt;
@@ -48,74 +115,475 @@ public:
 	   return mPC;
    }
 
+   /// Every value of the current activation, roots for the collector
+   template <class Fn> void values(Fn fn) {
+      for (llvm::DenseMap<Decl*, Slot>::iterator it = mVars.begin(), ie = mVars.end(); it != ie; ++it)
+         if (it->second.Gen == mGen) fn(it->second.Val);
+      for (llvm::DenseMap<Stmt*, Slot>::iterator it = mExprs.begin(), ie = mExprs.end(); it != ie; ++it)
+         if (it->second.Gen == mGen) fn(it->second.Val);
+   }
+
 };
 
 /// Heap maps address to a value
-
+/// Guest memory is a set of blocks. A block of size n holds n word slots at
+/// guest addresses base, base+4, ..., and an address is rounded up to a word
+/// before it is looked up. Guest addresses come from a bump pointer and are
+/// never reused, so they are the same from run to run.
 class Heap {
-	std::map<long,long> mBufs;//map the address to size
-	std::map<long,long> mContents; //map the address to value
-public:
-	Heap():mBufs(),mContents(){
+	struct Block {
+		long Size;		/// Number of slots
+		long * Slots;
+		bool Mapped;	/// Slots come from mmap rather than calloc
+		bool Marked;	/// Reached during the current collection
+		bool Freed;		/// FREEd while guest threads ran, see Free
+	};
+	std::map<long, Block> mBlocks;	/// map the base address to the block
+	long mNext;						/// Next free guest address
+	long mWild;						/// Slot of an address outside every block
+
+	/// Bytes of slot storage, for the collector
+	long mLive;
+	long mAllocated;				/// Since the last collection
+	std::vector<Block *> mMarkStack;
+
+	/// Once guest threads exist, mBlocks is only touched under mLock, and
+	/// every Free bumps mEpoch so that no thread trusts its cached block.
+	/// A thread may still be past that check when another one frees the
+	/// block, so from then on Free never erases a block or its slots.
+	std::mutex mLock;
+	bool mThreaded;
+	std::atomic<unsigned long> mEpoch;
+	unsigned long mId;
+
+	/// The block of the previous access, one per host thread
+	struct Cache {
+		unsigned long Heap;
+		unsigned long Epoch;
+		long Base;
+		Block * Last;
+	};
+	static Cache & cache() {
+		static thread_local Cache c;
+		return c;
+	}
+	static unsigned long nextId() {
+		static std::atomic<unsigned long> next(0);
+		return ++next;
 	}
-	long Malloc(int size){
-		int *buf=(int *)malloc(size);
-		mBufs.insert(std::make_pair((long)buf,size));
-		for(int i=0;i<size;i++){
-			mContents.insert(std::make_pair((long)(buf+i),0));
+
+	/// Slot arrays at least this large are anonymous mappings: the kernel
+	/// zeroes their pages on first touch, and FREE hands them back with munmap
+	static const long MapThreshold = 128 << 10;
+	static const long PageSize = 4096;
+
+	/// Find the block holding an (aligned) address, NULL if there is none
+	Block * find(long addr, long & base) {
+		Cache & c = cache();
+		unsigned long epoch = mEpoch.load(std::memory_order_acquire);
+		if (c.Heap == mId && c.Epoch == epoch && addr >= c.Base && addr < c.Base + c.Last->Size * 4) {
+			base = c.Base;
+			return c.Last;
 		}
-		return (long)buf;
+
+		std::unique_lock<std::mutex> lock(mLock, std::defer_lock);
+		if (mThreaded) lock.lock();
+		std::map<long, Block>::iterator it = mBlocks.upper_bound(addr);
+		if (it == mBlocks.begin()) return NULL;
+		--it;
+		if (addr >= it->first + it->second.Size * 4 || it->second.Freed) return NULL;
+		c.Heap = mId;
+		c.Epoch = epoch;
+		c.Last = &it->second;
+		c.Base = base = it->first;
+		return c.Last;
 	}
 
-	long Free(long addr){
-		assert (mBufs.find(addr) != mBufs.end());
-		int * buf = (int *)addr;
-      	long size = mBufs.find(addr)->second;
-     	 mBufs.erase(mBufs.find(addr));
+	/// The slot of addr. An address outside every block, which -checked
+	/// reports before it gets here, reads and writes mWild instead.
+	long * slot(long addr) {
+		addr = (addr + 3) & ~3L;
+		long base = 0;
+		Block * block = find(addr, base);
+		if (!block) return &mWild;
+		return &block->Slots[(addr - base) / 4];
+	}
+	void release(Block & block) {
+		if (block.Mapped) munmap(block.Slots, block.Size * sizeof(long));
+		else free(block.Slots);
+	}
 
-      	for (int i = 0; i < size; i++) {
-      		assert (mContents.find((long)(buf+i)) != mContents.end());
-        	mContents.erase((long)(buf+i));
-      		}
-		
-		free(buf);
+public:
+	Heap():mBlocks(),mNext(0x10000),mWild(0),mLive(0),mAllocated(0),mMarkStack(),mLock(),mThreaded(false),mEpoch(0),mId(nextId()){
+	}
+
+	/// Called before the first guest thread starts
+	void setThreaded() {
+		mThreaded = true;
+	}
+	~Heap() {
+		for (std::map<long, Block>::iterator it = mBlocks.begin(), ie = mBlocks.end(); it != ie; ++it)
+			release(it->second);
+	}
+
+	long Malloc(long size){
+		if (size < 1) size = 1;
+		Block block;
+		block.Size = size;
+		block.Marked = false;
+		block.Freed = false;
+		block.Mapped = size * (long)sizeof(long) >= MapThreshold;
+		if (block.Mapped) {
+			void * slots = mmap(NULL, size * sizeof(long), PROT_READ | PROT_WRITE,
+					MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+			assert (slots != MAP_FAILED);
+			block.Slots = (long *)slots;
+		}
+		else {
+			block.Slots = (long *)calloc(size, sizeof(long));
+		}
+
+		std::unique_lock<std::mutex> lock(mLock, std::defer_lock);
+		if (mThreaded) lock.lock();
+		long buf = mNext;
+		mBlocks.insert(std::make_pair(buf, block));
+		mLive += size * sizeof(long);
+		mAllocated += size * sizeof(long);
+		/// Leave an unmapped page between blocks
+		mNext += (size * 4 + 2 * PageSize - 1) & ~(PageSize - 1);
+		return buf;
+	}
+
+	/// Free the block at addr; false, and nothing freed, if addr is not the
+	/// base of a live block
+	bool Free(long addr){
+		std::unique_lock<std::mutex> lock(mLock, std::defer_lock);
+		if (mThreaded) lock.lock();
+		std::map<long, Block>::iterator it = mBlocks.find(addr);
+		if (it == mBlocks.end() || it->second.Freed) return false;
+		mLive -= it->second.Size * sizeof(long);
+		if (mThreaded) {
+			/// Keep the block for threads that found it through their cache,
+			/// only hand the pages of a mapping back
+			it->second.Freed = true;
+			if (it->second.Mapped) madvise(it->second.Slots, it->second.Size * sizeof(long), MADV_DONTNEED);
+		}
+		else {
+			release(it->second);
+			mBlocks.erase(it);
+		}
+		mEpoch.fetch_add(1, std::memory_order_release);
+		return true;
 	}
 
 	// update the value of addr in the buf
 	void Update(long addr, long val) {
-		while((addr%4)!=0) addr=addr+1;
-      	assert (mContents.find(addr) != mContents.end());
-      	mContents[addr] = val;
+		*slot(addr) = val;
    }
 
    //get the value of addr in the buf
    	long Get(long addr) {
-	   	while((addr%4)!=0) addr=addr+1;
-      	assert (mContents.find(addr) != mContents.end());
-      	return mContents.find(addr)->second;
+		return *slot(addr);
     }
 
+	/// The slots of n > 0 elements of size bytes starting at addr, checked
+	/// once for the whole range like Check; NULL if the range is not inside
+	/// one allocation
+	long * Span(long addr, long n, long size) {
+		addr = (addr + 3) & ~3L;
+		long base = 0;
+		Block * block = find(addr, base);
+		if (!block || n <= 0 || n > block->Size / size - (addr - base) / 4) return NULL;
+		return &block->Slots[(addr - base) / 4];
+	}
+
+	/// Atomically add val to the value of addr, return the old value
+	long AtomicAdd(long addr, long val) {
+		return __atomic_fetch_add(slot(addr), val, __ATOMIC_SEQ_CST);
+	}
+
+	/// Atomically replace the value of addr by desired if it equals expected
+	bool AtomicCas(long addr, long expected, long desired) {
+		return __atomic_compare_exchange_n(slot(addr), &expected, desired, false,
+				__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+	}
+
+	/// Whether an access of size bytes at addr stays inside the allocation
+	/// that from points into, or just past. An allocation of n bytes has n
+	/// slots but holds n / size elements, one slot each.
+	bool Check(long from, long addr, long size) {
+		from = (from + 3) & ~3L;
+		addr = (addr + 3) & ~3L;
+		long base = 0;
+		Block * block = find(from, base);
+		if (!block) block = find(from - 4, base);
+		return block && addr >= base && (addr - base) / 4 < block->Size / size;
+	}
+
+	long Live() {
+		return mLive;
+	}
+	long Allocated() {
+		return mAllocated;
+	}
+
+	/// Conservative collection, for a heap no guest thread uses: Mark every
+	/// root, then Sweep. Any value that falls inside a block, or just past
+	/// its end, keeps the block and everything its words reach alive.
+	void Mark(long value) {
+		if (value < 0x10000 || value > mNext) return;
+		long addr = (value + 3) & ~3L;
+		long base = 0;
+		Block * block = find(addr, base);
+		if (!block) block = find(addr - 4, base);
+		if (block && !block->Marked) {
+			block->Marked = true;
+			mMarkStack.push_back(block);
+		}
+	}
+
+	/// Trace the heap words of the marked blocks and free every block that
+	/// was not reached, return the bytes reclaimed
+	long Sweep() {
+		while (!mMarkStack.empty()) {
+			Block * block = mMarkStack.back();
+			mMarkStack.pop_back();
+			for (long i = 0; i < block->Size; ++i)
+				Mark(block->Slots[i]);
+		}
+		long reclaimed = 0;
+		for (std::map<long, Block>::iterator it = mBlocks.begin(), ie = mBlocks.end(); it != ie; ) {
+			if (it->second.Marked) {
+				it->second.Marked = false;
+				++it;
+				continue;
+			}
+			reclaimed += it->second.Size * sizeof(long);
+			release(it->second);
+			mBlocks.erase(it++);
+		}
+		mLive -= reclaimed;
+		mAllocated = 0;
+		mEpoch.fetch_add(1, std::memory_order_release);
+		return reclaimed;
+	}
+
+};
+
+
+/// Where GET takes its values from
+class InputSource {
+public:
+	virtual ~InputSource() {}
+	/// Read the next integer, return false once the input is exhausted
+	virtual bool get(int & val) = 0;
+};
+
+/// The interactive default, prompt and scanf from stdin
+class StdinInput : public InputSource {
+public:
+	virtual bool get(int & val) {
+		llvm::errs() << "Please Input an Integer Value : \n";
+		return scanf("%d", &val) == 1;
+	}
+};
+
+/// GET from an input stream read up front, prompting on out like StdinInput
+class StringInput : public InputSource {
+	std::string mInput;
+	size_t mPos;
+	llvm::raw_ostream & mOut;
+public:
+	StringInput(const std::string & input, llvm::raw_ostream & out) : mInput(input), mPos(0), mOut(out) {
+	}
+
+	virtual bool get(int & val) {
+		mOut << "Please Input an Integer Value : \n";
+		const char * start = mInput.c_str() + mPos;
+		char * end = NULL;
+		long read = strtol(start, &end, 10);
+		if (end == start) return false;
+		val = read;
+		mPos += end - start;
+		return true;
+	}
+};
+
+/// GET for -record and -replay: values read from in go into the trace, or
+/// with no in they come back out of it
+class TraceInput : public InputSource {
+	InputSource * mIn;
+	Trace & mTrace;
+public:
+	TraceInput(InputSource * in, Trace & trace) : mIn(in), mTrace(trace) {
+	}
+
+	virtual bool get(int & val) {
+		bool read = !mIn || mIn->get(val);
+		return mTrace.get(val, read);
+	}
 };
 
+class GuestThreads;
 
 class Environment {
-   	std::vector<StackFrame> mStack;
-  	std::vector<StackFrame> mVarGlobal;  /// Store the global var
-   	Heap mHeap;
+   	std::vector<StackFrame> mStack;   /// Frame pool, only mStack[0, mDepth) is live
+   	unsigned mDepth;
+  	/// The global segment. Every global var decl of every linked unit maps
+  	/// to its cell, a block-scope extern once its function is prepared;
+  	/// decls of one external name share a cell. Guest threads copy both
+  	/// maps, so the externs they map find the program's cells.
+  	llvm::DenseMap<Decl *, long *> mVarGlobal;
+  	llvm::StringMap<long *> mGlobalNames;
+  	std::deque<long> mGlobalSegment;
+  	long mRetVal;           /// Return value slot, written by ret and read by leave
+   	Heap mOwnHeap;
+   	Heap * mHeap;           /// mOwnHeap, or the heap of the program that spawned this thread
+
+	llvm::DenseMap<FunctionDecl *, FunctionInfo *> mFunctions;	/// Prepared functions by canonical decl
+	llvm::StringMap<FunctionDecl *> mDefinitions;				/// Linked external functions by name
+	llvm::StringMap<Decl *> mLinked;							/// First definition of every external name
+	std::deque<FunctionInfo> mInfos;
 
-	FunctionDecl * mFree;				/// Declartions to the built-in functions
-	FunctionDecl * mMalloc;
-	FunctionDecl * mInput;
-	FunctionDecl * mOutput;
+	/// Call sites decided so far, with the callee that runs in the caller's
+	/// frame or NULL, see setInlining
+	llvm::DenseMap<CallExpr *, FunctionInfo *> mInlined;
+	unsigned mInlineSize;		/// Largest inlinable body in AST nodes, 0 disables inlining
+	unsigned mInlineDepth;		/// Deepest nesting of inlined calls in one frame
+	struct Inlining {
+		unsigned Depth;			/// The frame it runs in
+		FunctionInfo * Callee;
+	};
+	std::vector<Inlining> mInlining;	/// Inlined calls running now, innermost last
+	struct InlineSite {
+		CallExpr * Call;
+		FunctionDecl * Caller;
+		FunctionDecl * Callee;
+		const char * Reason;	/// NULL if inlined
+	};
+	std::vector<InlineSite> mInlineSites;
 
 	FunctionDecl * mEntry;
 	bool Returnflag=false;             
+
+	Snapshot * mSnapshot;				/// Taken at the first GET, if any
+
+	/// The collector runs when this many bytes were allocated since the
+	/// last collection, or as many as are live if that is more; 0 disables it
+	long mGcThreshold;
+	bool mGcReport;						/// A line per collection on stderr
+	unsigned mGcCount;
+	long mGcReclaimed;
+	double mGcPause, mGcMaxPause;		/// Milliseconds
+
+	Profiler * mProfiler;				/// Follows the guest call stack, if any
+	PerfCounters * mCounters;			/// Charged at every guest call and return, if any
+	Trace * mTrace;						/// Records or checks every allocation, if any
+
+	/// Checked mode validates every load and store against the allocation
+	/// of its pointer, except accesses proven in bounds when prepared
+	bool mChecked;
+	llvm::DenseSet<Stmt *> mProven;
+	unsigned long mChecks, mElided;
+
+	/// Set by a failed memory access: every statement after it is skipped,
+	/// so the run unwinds to its caller, which reports failed(). Shared by
+	/// the threads of a program.
+	std::atomic<bool> mOwnFaulted;
+	std::atomic<bool> * mFaulted;
+
+	StdinInput mStdin;
+	InputSource * mIn;					/// GET reads from here
+	llvm::raw_ostream * mOut;			/// PRINT writes here
+
 public:
-	Environment() : mStack(), mFree(NULL), mMalloc(NULL), mInput(NULL), mOutput(NULL), mEntry(NULL) {
+	/// Runs a guest function body on this Environment, see setRunner
+	typedef void (*Runner)(Environment *, FunctionDecl *);
+private:
+	Runner mRunner;
+	std::unique_ptr<GuestThreads> mOwnThreads;	/// Created by the first SPAWN
+	GuestThreads * mThreads;					/// Shared by every thread of the program
+	std::mutex * mIOLock;						/// Serializes GET and PRINT once threads exist
+	bool mSession;								/// Hosted on a SessionLoop coroutine, see setSession
+public:
+	Environment() : mStack(), mDepth(0), mVarGlobal(), mGlobalNames(), mGlobalSegment(), mRetVal(0), mOwnHeap(), mHeap(&mOwnHeap),
+		mFunctions(), mDefinitions(), mLinked(), mInfos(), mInlined(), mInlineSize(0), mInlineDepth(0), mInlining(), mInlineSites(), mEntry(NULL), mSnapshot(NULL),
+		mGcThreshold(0), mGcReport(false), mGcCount(0), mGcReclaimed(0), mGcPause(0), mGcMaxPause(0), mProfiler(NULL), mCounters(NULL), mTrace(NULL),
+		mChecked(false), mProven(), mChecks(0), mElided(0), mOwnFaulted(false), mFaulted(&mOwnFaulted), mStdin(), mIn(&mStdin), mOut(&llvm::errs()), mRunner(NULL), mOwnThreads(), mThreads(NULL), mIOLock(NULL), mSession(false) {
+	}
+
+	/// A guest thread: frames of its own, but the heap, globals, functions
+	/// and I/O of the program that spawned it
+	explicit Environment(Environment * parent) : mStack(), mDepth(0), mVarGlobal(parent->mVarGlobal), mGlobalNames(parent->mGlobalNames), mGlobalSegment(),
+		mRetVal(0), mOwnHeap(), mHeap(parent->mHeap), mFunctions(parent->mFunctions), mDefinitions(parent->mDefinitions), mLinked(), mInfos(),
+		mInlined(parent->mInlined), mInlineSize(parent->mInlineSize), mInlineDepth(parent->mInlineDepth), mInlining(), mInlineSites(), mEntry(parent->mEntry), mSnapshot(NULL),
+		mGcThreshold(0), mGcReport(false), mGcCount(0), mGcReclaimed(0), mGcPause(0), mGcMaxPause(0), mProfiler(NULL), mCounters(NULL), mTrace(parent->mTrace),
+		mChecked(parent->mChecked), mProven(parent->mProven), mChecks(0), mElided(0),
+		mOwnFaulted(false), mFaulted(parent->mFaulted), mStdin(), mIn(parent->mIn), mOut(parent->mOut), mRunner(parent->mRunner),
+		mOwnThreads(), mThreads(parent->mThreads), mIOLock(parent->mIOLock), mSession(parent->mSession) {
+	}
+
+	inline ~Environment();
+
+	void setRunner(Runner runner) {
+		mRunner = runner;
+	}
+
+	void setInput(InputSource * in) {
+		mIn = in;
+	}
+
+	void setOutput(llvm::raw_ostream * out) {
+		mOut = out;
+	}
+
+	/// The run is a Session on a SessionLoop: its GET and PRINT switch to
+	/// the loop's coroutine, which only the loop's own thread may do, so
+	/// SPAWN fails the run instead of starting a host thread
+	void setSession() {
+		mSession = true;
+	}
+
+	void setSnapshot(Snapshot * snapshot) {
+		mSnapshot = snapshot;
+	}
+
+	/// Inline calls to functions of at most size AST nodes, at most depth
+	/// calls deep in one frame. Set before the run: each call site is
+	/// decided the first time it runs.
+	void setInlining(unsigned size, unsigned depth) {
+		mInlineSize = size;
+		mInlineDepth = depth;
+	}
+
+	/// Collect unreachable guest memory every threshold bytes allocated
+	void setCollector(long threshold, bool report) {
+		mGcThreshold = threshold;
+		mGcReport = report;
+	}
+
+	/// Validate guest memory accesses, set before init
+	void setChecked(bool checked) {
+		mChecked = checked;
+	}
+
+	/// Set before init, so that main is on the profiler's stack
+	void setProfiler(Profiler * profiler) {
+		mProfiler = profiler;
+	}
+
+	/// Set before init, so that main is counted too
+	void setCounters(PerfCounters * counters) {
+		mCounters = counters;
+	}
+
+	/// Set before the run, so that every allocation is in the trace
+	void setTrace(Trace * trace) {
+		mTrace = trace;
 	}
    
     bool isReturn(){                   /// Represent the current function call is returned or not
-	  return Returnflag;
+	  return Returnflag || mFaulted->load(std::memory_order_relaxed);
    	}
    	void setReturn(){                  ///  used when a function call begin or return 
 	   Returnflag=!Returnflag;
@@ -124,37 +592,296 @@ public:
 
    /// Initialize the Environment
 	void init(TranslationUnitDecl * unit) {
+		link(unit);
+		start();
+	}
+
+	/// Add one translation unit to the program. Its function definitions
+	/// join the symbol table that calls into other units resolve against,
+	/// and its global vars join the global segment. Returns false, with a
+	/// message on errs, if it defines an external name, main included, that
+	/// an earlier unit already defines.
+	bool link(TranslationUnitDecl * unit) {
+		bool ok = true;
 		for (TranslationUnitDecl::decl_iterator i =unit->decls_begin(), e = unit->decls_end(); i != e; ++ i) {
+			/// Functions are only prepared when they are first called
 			if (FunctionDecl * fdecl = dyn_cast<FunctionDecl>(*i) ) {
-				if (fdecl->getName().equals("FREE")) mFree = fdecl;
-				else if (fdecl->getName().equals("MALLOC")) mMalloc = fdecl;
-				else if (fdecl->getName().equals("GET")) mInput = fdecl;
-				else if (fdecl->getName().equals("PRINT")) mOutput = fdecl;
-				else if (fdecl->getName().equals("main")) mEntry = fdecl;
+				if (fdecl->hasBody() && fdecl->isThisDeclarationADefinition()) {
+					if (fdecl->isExternallyVisible()) ok = define(fdecl) && ok;
+					if (fdecl->getName().equals("main")) mEntry = fdecl;
+					else if (fdecl->isExternallyVisible()) mDefinitions[fdecl->getName()] = fdecl;
+				}
 			}
 
 		   	/// Process the global var decl
 			/// !TODO Support global array decl
 		 	if(VarDecl *vardecl=dyn_cast<VarDecl>(*i)){
-		 		if( !(vardecl->hasInit()) ){
-		 			StackFrame stack;
-		 			stack.bindDecl(vardecl,0);
-		 			mVarGlobal.push_back(stack);
-		 		}
-		 		else if( vardecl->hasInit()){
-		 			if(isa<IntegerLiteral>(vardecl->getInit()))
-              		{
-                  		StackFrame stack;
-                  		IntegerLiteral *integer=dyn_cast<IntegerLiteral>(vardecl->getInit());
-                  		int val=integer->getValue().getSExtValue();
-                  		stack.bindDecl(vardecl, val);
-                  		mVarGlobal.push_back(stack);
-              		}
+		 		if (vardecl->isExternallyVisible() && vardecl->isThisDeclarationADefinition() != VarDecl::DeclarationOnly)
+		 			ok = define(vardecl) && ok;
+		 		long * cell = global(vardecl);
+		 		if( vardecl->hasInit() && isa<IntegerLiteral>(vardecl->getInit()) ){
+              		IntegerLiteral *integer=dyn_cast<IntegerLiteral>(vardecl->getInit());
+              		*cell=integer->getValue().getSExtValue();
 		 		}
 		 	}
 	   	}
-	   mStack.push_back(StackFrame());
-   }
+		return ok;
+	}
+
+	/// Claim the name of an external definition for decl
+	bool define(NamedDecl * decl) {
+		Decl *& first = mLinked[decl->getName()];
+		if (!first || first == decl) {
+			first = decl;
+			return true;
+		}
+		SourceManager & sm = decl->getASTContext().getSourceManager();
+		SourceManager & firstsm = first->getASTContext().getSourceManager();
+		llvm::errs() << sm.getFilename(decl->getLocation()) << ":" << sm.getSpellingLineNumber(decl->getLocation())
+			<< ": duplicate definition of '" << decl->getName() << "', first defined at "
+			<< firstsm.getFilename(first->getLocation()) << ":" << firstsm.getSpellingLineNumber(first->getLocation()) << "\n";
+		return false;
+	}
+
+	/// Whether a var lives in the global segment: vars at file scope, and
+	/// extern declarations of them inside a function
+	static bool isGlobal(VarDecl * vardecl) {
+		return !vardecl->isLocalVarDeclOrParm() || vardecl->hasExternalStorage();
+	}
+
+	/// Find or allocate the cell of a global var. Redeclarations share the
+	/// cell of their canonical decl, and externally visible globals of all
+	/// units share the cell of their name.
+	long * global(VarDecl * vardecl) {
+		Decl * canonical = vardecl->getCanonicalDecl();
+		long * cell = mVarGlobal.lookup(canonical);
+		if (!cell && vardecl->isExternallyVisible()) cell = mGlobalNames.lookup(vardecl->getName());
+		if (!cell) {
+			mGlobalSegment.push_back(0);
+			cell = &mGlobalSegment.back();
+			if (vardecl->isExternallyVisible()) mGlobalNames[vardecl->getName()] = cell;
+		}
+		mVarGlobal[canonical] = cell;
+		mVarGlobal[vardecl] = cell;
+		return cell;
+	}
+
+	/// Enter main once every unit is linked
+	void start() {
+	   push(mEntry ? prepare(mEntry) : NULL);
+	   if (mProfiler && mEntry) mProfiler->enter(mEntry);
+	   if (mCounters && mEntry) mCounters->enter(mEntry);
+	}
+
+	/// Frames are never destroyed: a call reuses the pooled frame at the
+	/// next depth, so the call path does not allocate once the pool is warm.
+	StackFrame & push(FunctionInfo * function) {
+		if (mDepth == mStack.size()) mStack.push_back(StackFrame());
+		StackFrame & frame = mStack[mDepth++];
+		frame.reset(function);
+		return frame;
+	}
+
+	/// Look up the prepared form of a function, preparing it on first use:
+	/// builtins are resolved by name, everything else gets its definition
+	/// and the sizes of its local arrays.
+	FunctionInfo * prepare(FunctionDecl * fdecl) {
+		FunctionDecl * canonical = fdecl->getCanonicalDecl();
+		llvm::DenseMap<FunctionDecl *, FunctionInfo *>::iterator it = mFunctions.find(canonical);
+		if (it != mFunctions.end()) return it->second;
+
+		mInfos.push_back(FunctionInfo());
+		FunctionInfo * info = &mInfos.back();
+		mFunctions[canonical] = info;
+		if (fdecl->getName().equals("FREE")) info->Builtin = FunctionInfo::Free;
+		else if (fdecl->getName().equals("MALLOC")) info->Builtin = FunctionInfo::Malloc;
+		else if (fdecl->getName().equals("GET")) info->Builtin = FunctionInfo::Get;
+		else if (fdecl->getName().equals("PRINT")) info->Builtin = FunctionInfo::Print;
+		else if (fdecl->getName().equals("SPAWN")) info->Builtin = FunctionInfo::Spawn;
+		else if (fdecl->getName().equals("JOIN")) info->Builtin = FunctionInfo::Join;
+		else if (fdecl->getName().equals("ATOMIC_ADD")) info->Builtin = FunctionInfo::AtomicAdd;
+		else if (fdecl->getName().equals("ATOMIC_CAS")) info->Builtin = FunctionInfo::AtomicCas;
+		else if (fdecl->getName().equals("BARRIER")) info->Builtin = FunctionInfo::Barrier;
+		else if (fdecl->getName().equals("MEMSET")) info->Builtin = FunctionInfo::MemSet;
+		else if (fdecl->getName().equals("MEMCPY")) info->Builtin = FunctionInfo::MemCpy;
+		else if (fdecl->getName().equals("MEMCMP")) info->Builtin = FunctionInfo::MemCmp;
+		else if (fdecl->getName().equals("SUM_INT")) info->Builtin = FunctionInfo::SumInt;
+		else if (fdecl->getName().equals("MAX_INT")) info->Builtin = FunctionInfo::MaxInt;
+		else if (fdecl->getName().equals("FILL_RANGE")) info->Builtin = FunctionInfo::FillRange;
+		else {
+			/// A definition in this unit, or else one linked from another unit
+			info->Def = fdecl->getDefinition();
+			if (!info->Def) info->Def = mDefinitions.lookup(fdecl->getName());
+			if (info->Def) {
+				if (mChecked) BoundsAnalysis(mProven).run(info->Def);
+				collect(info, info->Def->getBody());
+				info->NoInline = inlinable(info);
+				info->Inline = info->NoInline ? FunctionInfo::NotInlinable : FunctionInfo::Inlinable;
+			}
+		}
+		return info;
+	}
+
+	/// Walk a body once and record what running it will need: the sizes
+	/// of its local arrays, and the global cells of its block-scope extern
+	/// declarations, which only get mapped once their function is prepared
+	void collect(FunctionInfo * info, Stmt * stmt) {
+		if (!stmt) return;
+		if (DeclStmt * declstmt = dyn_cast<DeclStmt>(stmt)) {
+			for (DeclStmt::decl_iterator it = declstmt->decl_begin(), ie = declstmt->decl_end(); it != ie; ++it) {
+				VarDecl * vardecl = dyn_cast<VarDecl>(*it);
+				if (vardecl && vardecl->hasExternalStorage())
+					global(vardecl);
+				else if (vardecl && vardecl->getType()->isArrayType())
+					info->ArraySizes[vardecl] = arraySize(vardecl);
+			}
+		}
+		for (Stmt * child : stmt->children())
+			collect(info, child);
+	}
+
+	/// Decide a call site the first time it runs, so that only callees
+	/// that are about to be called get prepared: it is inlined if its
+	/// callee is inlinable and in the unit of the function the call is in
+	FunctionInfo * site(CallExpr * callexpr) {
+		FunctionDecl * fdecl = callexpr->getDirectCallee();
+		FunctionInfo * callee = fdecl ? prepare(fdecl) : NULL;
+		if (!callee || callee->Builtin != FunctionInfo::None || !callee->Def) {
+			mInlined[callexpr] = NULL;
+			return NULL;
+		}
+
+		FunctionInfo * caller = lexical();
+		InlineSite site = { callexpr, caller->Def, callee->Def, callee->NoInline };
+		if (!site.Reason && &callee->Def->getASTContext() != &caller->Def->getASTContext()) site.Reason = "other unit";
+		mInlined[callexpr] = site.Reason ? NULL : callee;
+		mInlineSites.push_back(site);
+		return site.Reason ? NULL : callee;
+	}
+
+	/// The function whose body is running: the innermost callee inlined in
+	/// the current frame, or the function of the frame
+	FunctionInfo * lexical() {
+		if (!mInlining.empty() && mInlining.back().Depth == mDepth) return mInlining.back().Callee;
+		return top().getFunction();
+	}
+
+	/// Split a prepared function into prologue, guards and final return,
+	/// return why it cannot be inlined or NULL
+	const char * inlinable(FunctionInfo * info) {
+		if (!mInlineSize) return "disabled";
+		if (info->Def == mEntry) return "entry";
+		if (size(info->Def->getBody()) > mInlineSize) return "too large";
+		CompoundStmt * body = dyn_cast<CompoundStmt>(info->Def->getBody());
+		if (!body) return "no body";
+
+		std::vector<Stmt *> stmts(body->body_begin(), body->body_end());
+		size_t end = stmts.size();
+		if (end > 0 && isa<ReturnStmt>(stmts[end - 1])) {
+			info->Result = dyn_cast<ReturnStmt>(stmts[end - 1])->getRetValue();
+			--end;
+		}
+		size_t guards = end;
+		while (guards > 0 && guard(stmts[guards - 1])) --guards;
+		for (size_t i = 0; i < guards; ++i) {
+			if (returns(stmts[i])) return "return shape";
+			info->Prologue.push_back(stmts[i]);
+		}
+		for (size_t i = guards; i < end; ++i) {
+			IfStmt * ifstmt = dyn_cast<IfStmt>(stmts[i]);
+			info->Guards.push_back(std::make_pair(ifstmt->getCond(), guard(ifstmt)->getRetValue()));
+		}
+		return NULL;
+	}
+
+	/// The return of `if (c) return e;` without else, NULL for other statements
+	static ReturnStmt * guard(Stmt * stmt) {
+		IfStmt * ifstmt = dyn_cast<IfStmt>(stmt);
+		if (!ifstmt || ifstmt->getElse() || returns(ifstmt->getCond())) return NULL;
+		Stmt * then = ifstmt->getThen();
+		if (CompoundStmt * block = dyn_cast<CompoundStmt>(then))
+			then = block->size() == 1 ? block->body_back() : NULL;
+		return then ? dyn_cast<ReturnStmt>(then) : NULL;
+	}
+
+	static bool returns(Stmt * stmt) {
+		if (!stmt) return false;
+		if (isa<ReturnStmt>(stmt)) return true;
+		for (Stmt * child : stmt->children())
+			if (returns(child)) return true;
+		return false;
+	}
+
+	static unsigned size(Stmt * stmt) {
+		if (!stmt) return 0;
+		unsigned n = 1;
+		for (Stmt * child : stmt->children())
+			n += size(child);
+		return n;
+	}
+
+	/// The callee to run in the current frame at this call site, if any.
+	/// An inlined site still calls its callee normally where the callee
+	/// already runs in this frame, which is recursion, or where inlined
+	/// calls are already nested mInlineDepth deep in this frame.
+	FunctionInfo * inlined(CallExpr * callexpr) {
+		if (!mInlineSize) return NULL;
+		llvm::DenseMap<CallExpr *, FunctionInfo *>::iterator it = mInlined.find(callexpr);
+		FunctionInfo * callee = it != mInlined.end() ? it->second : site(callexpr);
+		if (!callee || top().getFunction() == callee) return NULL;
+		unsigned nested = 0;
+		for (size_t i = mInlining.size(); i > 0 && mInlining[i - 1].Depth == mDepth; --i, ++nested)
+			if (mInlining[i - 1].Callee == callee) return NULL;
+		return nested < mInlineDepth ? callee : NULL;
+	}
+
+	/// Bind the arguments of an inlined call to the callee's parameters in
+	/// the current frame; the callee's decls never clash with the caller's
+	void enterInline(CallExpr * callexpr, FunctionInfo * callee) {
+		setPC(callexpr);
+		StackFrame & frame = top();
+		auto param = callee->Def->param_begin();
+		for (CallExpr::arg_iterator it = callexpr->arg_begin(), ie = callexpr->arg_end(); it != ie; ++it, ++param)
+			frame.bindDecl(*param, frame.getStmtVal(*it));
+		Inlining inlining = { mDepth, callee };
+		mInlining.push_back(inlining);
+	}
+
+	/// Always paired with enterInline, also when the run faulted inside
+	void leaveInline(CallExpr * callexpr, Expr * result) {
+		mInlining.pop_back();
+		top().bindStmt(callexpr, result && !isReturn() ? top().getStmtVal(result) : 0);
+	}
+
+	/// One line per call site decided so far
+	void reportInlining(llvm::raw_ostream & os) {
+		for (unsigned i = 0; i < mInlineSites.size(); ++i) {
+			InlineSite & site = mInlineSites[i];
+			SourceManager & sm = site.Caller->getASTContext().getSourceManager();
+			os << site.Caller->getName() << ":" << sm.getSpellingLineNumber(site.Call->getLocStart()) << ": "
+				<< site.Callee->getName();
+			if (site.Reason) os << " not inlined (" << site.Reason << ")\n";
+			else os << " inlined\n";
+		}
+	}
+
+	/// Bytes of a local array, element size times the declared length
+	static long arraySize(VarDecl * vardecl) {
+		const ArrayType * array = vardecl->getType()->getAsArrayTypeUnsafe();
+		long size = array->getElementType()->isCharType() ? sizeof(char) : sizeof(int);
+		if (const ConstantArrayType * constant = dyn_cast<ConstantArrayType>(array))
+			size *= constant->getSize().getSExtValue();
+		return size;
+	}
+
+	StackFrame & top() {
+		return mStack[mDepth - 1];
+	}
+
+	void setPC(Stmt * stmt) {
+		top().setPC(stmt);
+		if (mProfiler) mProfiler->setPC(stmt);
+	}
 
 
 
@@ -162,12 +889,18 @@ public:
 	   return mEntry;
    }
 
+	/// Values are kept as long so that guest addresses survive, results of
+	/// int type wrap around the way they would in the guest
+	static long value(Expr * expr, long val) {
+		return expr->getType()->isPointerType() ? val : (int)val;
+	}
+
    /// !TODO Support comparison operation
 	void binop(BinaryOperator *bop) {
 		Expr * left = bop->getLHS();
 		Expr * right = bop->getRHS();
-		int valLeft=mStack.back().getStmtVal(left);
-		int valRight=mStack.back().getStmtVal(right);
+		long valLeft=top().getStmtVal(left);
+		long valRight=top().getStmtVal(right);
        
 	   	if (bop->isAssignmentOp()) {
 		   	if(isa<ArraySubscriptExpr>(left))
@@ -175,22 +908,24 @@ public:
 				ArraySubscriptExpr *array=dyn_cast<ArraySubscriptExpr>(left);
 				Expr *base_expr=array->getBase();
 				//get the base of the array
-				long base=mStack.back().getStmtVal(base_expr);
+				long base=top().getStmtVal(base_expr);
 				Expr *offset_expr=array->getIdx();
 				//get the offset index of the array, here is an integerliteral
-				long offset=mStack.back().getStmtVal(offset_expr);
-				mHeap.Update(base + offset*sizeof(int), valRight);
+				long offset=top().getStmtVal(offset_expr);
+				if (mChecked && !check(array, provenance(base_expr), base + offset*sizeof(int))) return;
+				mHeap->Update(base + offset*sizeof(int), valRight);
 			}
 		
 			if(isa<UnaryOperator>(left)){
 				UnaryOperator* uop= dyn_cast<UnaryOperator>(left);
 				if((uop->getOpcode())==UO_Deref){  /// *a
 					Expr* expr=uop->getSubExpr();
-					long addr=mStack.back().getStmtVal(expr);
-					mHeap.Update(addr,valRight);
+					long addr=top().getStmtVal(expr);
+					if (mChecked && !check(uop, provenance(expr), addr)) return;
+					mHeap->Update(addr,valRight);
 				}
 			}
-		   mStack.back().bindStmt(left, valRight);
+		   top().bindStmt(left, valRight);
 		   if (DeclRefExpr * declexpr = dyn_cast<DeclRefExpr>(left)) {
 			   Decl * decl = declexpr->getFoundDecl();
 			   this->bindDecl(decl, valRight);
@@ -204,11 +939,11 @@ public:
 	   		{
 		   		//+
 		   		case BO_Add:
-		   		mStack.back().bindStmt(bop,valLeft+valRight);
+		   		top().bindStmt(bop,value(bop,valLeft+valRight));
 		   		break;
 		   		//-
 		   		case BO_Sub:
-		   		mStack.back().bindStmt(bop,valLeft-valRight);
+		   		top().bindStmt(bop,value(bop,valLeft-valRight));
 		   		break;
 	   		}
 	   	}
@@ -218,7 +953,7 @@ public:
 	   		{
 	   		//*
 	   			case BO_Mul:
-	   			mStack.back().bindStmt(bop,valLeft * valRight);
+	   			top().bindStmt(bop,value(bop,valLeft * valRight));
 	   			break;
 	   		}
 	   	}
@@ -228,43 +963,43 @@ public:
 	   		{
 	   			case BO_LT: /// <
 	   				if( valLeft < valRight )
-	   					mStack.back().bindStmt(bop,true);
+	   					top().bindStmt(bop,true);
 	   				else
-	   					mStack.back().bindStmt(bop,false);
+	   					top().bindStmt(bop,false);
 	   				break;
 		   		case BO_GT: /// >
 			   		if( valLeft > valRight )
-			   			mStack.back().bindStmt(bop,true);
+			   			top().bindStmt(bop,true);
 			   		else
-			   			mStack.back().bindStmt(bop,false);
+			   			top().bindStmt(bop,false);
 			   		break;
 		   		//>=
 		   		case BO_GE:
 			   		if( valLeft >= valRight )
-			   			mStack.back().bindStmt(bop,true);
+			   			top().bindStmt(bop,true);
 			   		else
-			   			mStack.back().bindStmt(bop,false);
+			   			top().bindStmt(bop,false);
 			   		break;
 		   		//<=
 		   		case BO_LE:
 			   		if( valLeft <= valRight )
-			   			mStack.back().bindStmt(bop,true);
+			   			top().bindStmt(bop,true);
 			   		else
-			   			mStack.back().bindStmt(bop,false);
+			   			top().bindStmt(bop,false);
 			   		break;
 		   		//==
 		   		case BO_EQ:
 			   		if( valLeft == valRight )
-			   			mStack.back().bindStmt(bop,true);
+			   			top().bindStmt(bop,true);
 			   		else
-			   			mStack.back().bindStmt(bop,false);
+			   			top().bindStmt(bop,false);
 			   		break;
 		   		//!=
 		   		case BO_NE:
 			   		if( valLeft != valRight )
-			   			mStack.back().bindStmt(bop,true);
+			   			top().bindStmt(bop,true);
 			   		else
-			   			mStack.back().bindStmt(bop,false);
+			   			top().bindStmt(bop,false);
 			   		break;
 		   		default:
 			   		cout<<" invalid input comparisons! "<<endl;
@@ -276,16 +1011,17 @@ public:
    
    void unaryop(UnaryOperator *uop){	   
 		Expr * expr=uop->getSubExpr();
-		long val=mStack.back().getStmtVal(expr);
+		long val=top().getStmtVal(expr);
 		switch(uop->getOpcode()){
 			case UO_Plus: // +a
-				mStack.back().bindStmt(uop,val);
+				top().bindStmt(uop,val);
 				break;
 			case UO_Minus: // -a
-				mStack.back().bindStmt(uop,-val);
+				top().bindStmt(uop,-val);
 				break;
 			case UO_Deref: // *a
-				mStack.back().bindStmt(uop,mHeap.Get(val));
+				if (mChecked && !check(uop, provenance(uop->getSubExpr()), val)) return;
+				top().bindStmt(uop,mHeap->Get(val));
 				break;
 	   }
    }
@@ -296,27 +1032,14 @@ public:
 			   it != ie; ++ it) {
 		   Decl * decl = *it;
 		   if (VarDecl * vardecl = dyn_cast<VarDecl>(decl)) {
+		   		if (vardecl->hasExternalStorage()) continue;	/// A global, mapped by link
 		   		if ( !(vardecl->hasInit()) ){ /// If the var is not initialized
 		   			if( !(vardecl->getType()->isArrayType()) ){
-						mStack.back().bindDecl(vardecl, 0);
+						top().bindDecl(vardecl, 0);
 		   			}
-		   			else{//Array type
-		   				int size=sizeof(int);
-		   				const auto&array=dyn_cast<ArrayType>(vardecl->getType());
-		   				if(array->getElementType()->isIntegerType()) size=sizeof(int);
-		   				if(array->getElementType()->isCharType()) size=sizeof(char);
-		   				string type=(vardecl->getType()).getAsString();
-						//we use the naive method to get size of the array by string match
-						//this method may be unsafe and unreusable
-			 			int indexLeft=type.find("[");
-			 			int indexRight=type.find("]");
-			 			if((indexLeft!=string::npos) && (indexRight!=string::npos))
-			 			{
-			 				string num=type.substr(indexLeft+1,indexRight-indexLeft-1);
-    						size*=atoi(num.c_str());
-			 			}
-		   				long buf=mHeap.Malloc(size);
-		   				mStack.back().bindDecl(vardecl,buf);
+		   			else{//Array type, sized when the function was prepared
+		   				long buf=allocate(lexical()->ArraySizes.lookup(vardecl));
+		   				top().bindDecl(vardecl,buf);
 		   			}
 
 		   		}
@@ -324,12 +1047,12 @@ public:
                     if(isa<IntegerLiteral>(vardecl->getInit())){
                         IntegerLiteral *integer=dyn_cast<IntegerLiteral>(vardecl->getInit());
                         int val=integer->getValue().getSExtValue();
-                        mStack.back().bindDecl(vardecl,val);
+                        top().bindDecl(vardecl,val);
 
                     }
                     else{
-                        int val=mStack.back().getStmtVal(vardecl->getInit()); 
-                        mStack.back().bindDecl(vardecl, val);
+                        long val=top().getStmtVal(vardecl->getInit()); 
+                        top().bindDecl(vardecl, val);
                     }
                     
 		   		}
@@ -342,63 +1065,107 @@ public:
 	   	#ifdef DEBUG
 			std::cout<<"enter declref"<<std::endl;
 		#endif
-	  	mStack.back().setPC(declref);
-	  	mStack.back().bindStmt(declref,0);
+	  	setPC(declref);
 	  	Decl* decl = declref->getFoundDecl();
-		int val = this->getDeclVal(decl);
-		mStack.back().bindStmt(declref, val);
+		if (isa<FunctionDecl>(decl)) {	/// the callee of a call, nothing to load
+			top().bindStmt(declref, (long)decl);
+			return;
+		}
+		long val = this->getDeclVal(decl);
+		top().bindStmt(declref, val);
    }
 
    	void cast(CastExpr * castexpr) {
-		mStack.back().setPC(castexpr);
+		setPC(castexpr);
 		Expr * expr = castexpr->getSubExpr();
 		if (castexpr->getType()->isIntegerType()){
-			int val = mStack.back().getStmtVal(expr);
-			mStack.back().bindStmt(castexpr, val );
+			int val = top().getStmtVal(expr);
+			top().bindStmt(castexpr, val );
 		}
 		else{
-			long val = mStack.back().getStmtVal(expr);
-			mStack.back().bindStmt(castexpr, val );
+			long val = top().getStmtVal(expr);
+			top().bindStmt(castexpr, val );
 		}
   	}
 
-   void call(CallExpr * callexpr) {
-	   mStack.back().setPC(callexpr);
+   /// Evaluate a call. Builtins are handled in place; for a guest function
+   /// a frame is pushed and its definition is returned for the caller to run.
+   FunctionDecl * call(CallExpr * callexpr) {
+	   setPC(callexpr);
 	   int val = 0;
-	   FunctionDecl * callee = callexpr->getDirectCallee();
-	   if (callee == mInput) {
-		  llvm::errs() << "Please Input an Integer Value : \n";
-		  scanf("%d", &val);
+	   FunctionInfo * callee = prepare(callexpr->getDirectCallee());
+	   if (callee->Builtin == FunctionInfo::Get) {
+		  if (mSnapshot) mSnapshot->take();
+		  std::unique_lock<std::mutex> io = lockIO();
+		  mIn->get(val);
 
-		  mStack.back().bindStmt(callexpr, val);
-	   } else if (callee == mOutput) {
+		  top().bindStmt(callexpr, val);
+	   } else if (callee->Builtin == FunctionInfo::Print) {
 		   Expr * decl = callexpr->getArg(0);
-		   val = mStack.back().getStmtVal(decl);
-		   llvm::errs() << val<<"\n";
-	   } else if (callee == mMalloc){
+		   val = top().getStmtVal(decl);
+		   std::unique_lock<std::mutex> io = lockIO();
+		   *mOut << val<<"\n";
+	   } else if (callee->Builtin == FunctionInfo::Malloc){
 		   Expr * decl = callexpr->getArg(0);
-		   val = mStack.back().getStmtVal(decl);
+		   val = top().getStmtVal(decl);
 		   //std::cout<<val<<std::endl;
-		   long buf=mHeap.Malloc(val);
-		   mStack.back().bindStmt(callexpr,buf);
-	   } else if(callee == mFree){
+		   long buf=allocate(val);
+		   top().bindStmt(callexpr,buf);
+	   } else if(callee->Builtin == FunctionInfo::Free){
 		   Expr * decl = callexpr->getArg(0);
-		   val = mStack.back().getStmtVal(decl);
-		   mHeap.Free(val);
-		   mStack.back().bindStmt(callexpr,0);
+		   long addr = top().getStmtVal(decl);
+		   if (!mHeap->Free(addr) && mChecked)
+			   fault(callexpr, "invalid FREE of guest address " + std::to_string(addr));
+		   top().bindStmt(callexpr,0);
+	   } else if (callee->Builtin == FunctionInfo::Spawn && mSession) {
+		   fault(callexpr, "SPAWN is not supported in -async and -serve sessions");
+		   top().bindStmt(callexpr, 0);
+	   } else if (callee->Builtin == FunctionInfo::Spawn) {
+		   FunctionDecl * fn = (FunctionDecl *)top().getStmtVal(callexpr->getArg(0));
+		   top().bindStmt(callexpr, spawn(prepare(fn), top().getStmtVal(callexpr->getArg(1))));
+	   } else if (callee->Builtin == FunctionInfo::Join) {
+		   top().bindStmt(callexpr, join(top().getStmtVal(callexpr->getArg(0))));
+	   } else if (callee->Builtin == FunctionInfo::AtomicAdd) {
+		   long addr = top().getStmtVal(callexpr->getArg(0));
+		   if (mChecked && !check(callexpr, provenance(callexpr->getArg(0)), addr)) {
+			   top().bindStmt(callexpr, 0);
+			   return NULL;
+		   }
+		   long old = mHeap->AtomicAdd(addr, top().getStmtVal(callexpr->getArg(1)));
+		   top().bindStmt(callexpr, value(callexpr, old));
+	   } else if (callee->Builtin == FunctionInfo::AtomicCas) {
+		   long addr = top().getStmtVal(callexpr->getArg(0));
+		   if (mChecked && !check(callexpr, provenance(callexpr->getArg(0)), addr)) {
+			   top().bindStmt(callexpr, 0);
+			   return NULL;
+		   }
+		   bool swapped = mHeap->AtomicCas(addr, top().getStmtVal(callexpr->getArg(1)), top().getStmtVal(callexpr->getArg(2)));
+		   top().bindStmt(callexpr, swapped);
+	   } else if (callee->Builtin == FunctionInfo::Barrier) {
+		   barrier(top().getStmtVal(callexpr->getArg(0)));
+		   top().bindStmt(callexpr,0);
+	   } else if (callee->Builtin >= FunctionInfo::MemSet) {
+		   top().bindStmt(callexpr, value(callexpr, bulk(callee->Builtin, callexpr)));
 	   }
-	   else{
-			StackFrame stack;
-			auto param=callee->param_begin();
+	   else if (FunctionDecl * def = callee->Def) {
+			/// Bind the arguments straight into the callee's pooled frame
+			StackFrame & frame = push(callee);
+			StackFrame & caller = mStack[mDepth - 2];
+			auto param=def->param_begin();
 			for(CallExpr::arg_iterator it=callexpr->arg_begin(), ie=callexpr->arg_end();it!=ie;++it,++param){
-				int val = mStack.back().getStmtVal(*it);
-				stack.bindDecl(*param,val);
+				frame.bindDecl(*param, caller.getStmtVal(*it));
 			}
-			mStack.push_back(stack);
+			if (mProfiler) mProfiler->enter(def);
+			if (mCounters) mCounters->enter(def);
 			#ifdef DEBUG
 			std::cout<<"leave call "<<std::endl;
 			#endif
-		}		   
+			return def;
+		}
+	   else{
+		   top().bindStmt(callexpr,0);
+	   }
+	   return NULL;
 	}
 	   
    
@@ -408,27 +1175,217 @@ public:
 				std::cout<<"enter ret "<<std::endl;
 			#endif
 			Expr* expr=retstmt->getRetValue();
-			long val = mStack.back().getStmtVal(expr);
+			mRetVal = expr ? top().getStmtVal(expr) : 0;
 			#ifdef DEBUG
-				std::cout<<"val of ret "<<val<<std::endl;
+				std::cout<<"val of ret "<<mRetVal<<std::endl;
 			#endif
-			mStack.pop_back();
-			Stmt * stmt =mStack.back().getPC();
-			mStack.back().bindStmt(stmt,val);
+			--mDepth;
+			if (mProfiler) mProfiler->leave();
+			if (mCounters) mCounters->leave();
    }
 
+	/// The bulk-memory builtins. Counts are in elements, since guest memory
+	/// is addressed by element; each range is bounds-checked once, in every
+	/// mode, and then handed to a native kernel.
+	///   MEMSET(p, v, n)  MEMCPY(dst, src, n)  MEMCMP(a, b, n)
+	///   SUM_INT(p, n)    MAX_INT(p, n)        FILL_RANGE(p, start, n)
+	long bulk(FunctionInfo::BuiltinKind kind, CallExpr * callexpr) {
+		long arg[3] = { 0, 0, 0 };
+		for (unsigned i = 0; i < callexpr->getNumArgs() && i < 3; ++i)
+			arg[i] = top().getStmtVal(callexpr->getArg(i));
+
+		long n = kind == FunctionInfo::SumInt || kind == FunctionInfo::MaxInt ? arg[1] : arg[2];
+		bool two = kind == FunctionInfo::MemCpy || kind == FunctionInfo::MemCmp;
+
+		/// Every range is validated, checked mode or not, against the block
+		/// its pointer points into: the kernels below write straight into
+		/// the slots
+		long * a = NULL;
+		long * b = NULL;
+		if (n <= 0) return kind == FunctionInfo::MemSet || kind == FunctionInfo::MemCpy ? arg[0] : 0;
+		if (!(a = span(callexpr, 0, arg[0], n))) return 0;
+		if (two && !(b = span(callexpr, 1, arg[1], n))) return 0;
+
+		switch (kind) {
+			case FunctionInfo::MemSet:
+				bulk::fill(a, arg[1], n);
+				return arg[0];
+			case FunctionInfo::MemCpy:
+				bulk::copy(a, b, n);
+				return arg[0];
+			case FunctionInfo::MemCmp:
+				return bulk::compare(a, b, n);
+			case FunctionInfo::SumInt:
+				return bulk::sum(a, n);
+			case FunctionInfo::MaxInt:
+				return bulk::max(a, n);
+			case FunctionInfo::FillRange:
+				bulk::range(a, arg[1], n);
+				return 0;
+			default:
+				return 0;
+		}
+	}
+
+	/// The slots of the n elements a bulk builtin touches at addr, its
+	/// argument i. A char buffer cast to the builtin's int * holds one
+	/// element per byte, like the char accesses Check allows.
+	long * span(CallExpr * callexpr, unsigned i, long addr, long n) {
+		const Type * element = callexpr->getArg(i)->IgnoreParenCasts()->getType()->getPointeeOrArrayElementType();
+		if (long * slots = mHeap->Span(addr, n, element->isCharType() ? sizeof(char) : sizeof(int))) return slots;
+		fault(callexpr, "out-of-bounds range of " + std::to_string(n) + " elements at guest address " + std::to_string(addr));
+		return NULL;
+	}
+
+	/// Allocate guest memory, collecting garbage first when it is due
+	long allocate(long size) {
+		if (mGcThreshold && mHeap->Allocated() >= std::max(mGcThreshold, mHeap->Live())) gc();
+		long addr = mHeap->Malloc(size);
+		if (mTrace) mTrace->malloc(size, addr);
+		return addr;
+	}
+
+	/// Conservative mark-sweep over the guest heap. The roots are the
+	/// current activation of every live frame, the global segment and the
+	/// return slot. Skipped once guest threads exist: their frames are not
+	/// at a safe point.
+	void gc() {
+		if (mThreads) return;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		Heap * heap = mHeap;
+		for (unsigned i = 0; i < mDepth; ++i)
+			mStack[i].values([heap](long val) { heap->Mark(val); });
+		for (std::deque<long>::iterator it = mGlobalSegment.begin(), ie = mGlobalSegment.end(); it != ie; ++it)
+			heap->Mark(*it);
+		heap->Mark(mRetVal);
+		long reclaimed = heap->Sweep();
+
+		double pause = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+		++mGcCount;
+		mGcReclaimed += reclaimed;
+		mGcPause += pause;
+		mGcMaxPause = std::max(mGcMaxPause, pause);
+		if (mGcReport)
+			llvm::errs() << "gc: reclaimed " << reclaimed << " bytes in " << pause << " ms, "
+				<< heap->Live() << " bytes live\n";
+	}
+
+	/// Totals of every collection so far
+	void reportCollector(llvm::raw_ostream & os) {
+		os << "gc: " << mGcCount << " collections, " << mGcReclaimed << " bytes reclaimed, pause "
+			<< mGcPause << " ms total, " << mGcMaxPause << " ms max\n";
+	}
+
+	/// Checked mode: an access of the type of access must stay inside the
+	/// allocation from points into. A failed check ends the run, and the
+	/// access must not be made.
+	bool check(Expr * access, long from, long addr) {
+		++mChecks;
+		if (mProven.count(access)) {
+			++mElided;
+			return true;
+		}
+		long size = access->getType()->isCharType() ? sizeof(char) : sizeof(int);
+		if (mHeap->Check(from, addr, size)) return true;
+		fault(access, "out-of-bounds access to guest address " + std::to_string(addr));
+		return false;
+	}
+
+	/// The value of the pointer an address was computed from: p for p + k,
+	/// k + p or (p + k) - j, so that an access is checked against the block
+	/// p points into and not whichever block the address lands in
+	long provenance(Expr * expr) {
+		for (;;) {
+			Expr * inner = expr->IgnoreParenCasts();
+			BinaryOperator * bop = dyn_cast<BinaryOperator>(inner);
+			if (!bop || !bop->isAdditiveOp() || !bop->getType()->isPointerType()) break;
+			expr = bop->getLHS()->getType()->isPointerType() ? bop->getLHS() : bop->getRHS();
+		}
+		return top().getStmtVal(expr);
+	}
+
+	/// Report a bad guest memory access at, with its function and line, on
+	/// the output of the run, and end the run
+	void fault(Expr * at, const std::string & what) {
+		{
+			std::unique_lock<std::mutex> io = lockIO();
+			*mOut << what;
+			if (FunctionInfo * fn = top().getFunction()) {
+				SourceManager & sm = fn->Def->getASTContext().getSourceManager();
+				*mOut << " in " << fn->Def->getName() << " at line " << sm.getSpellingLineNumber(at->getLocStart());
+			}
+			*mOut << "\n";
+		}
+		mFaulted->store(true);
+		if (mThreads) abortThreads();
+	}
+
+	/// Whether the run ended on a bad memory access
+	bool failed() {
+		return mFaulted->load();
+	}
+
+	/// How many checks ran and how many were elided
+	void reportChecks(llvm::raw_ostream & os) {
+		os << "checked: " << mChecks << " accesses, " << mElided << " checks elided";
+		if (mChecks) os << " (" << mElided * 100 / mChecks << "%)";
+		os << "\n";
+	}
+
+	/// Run fn(arg) as the body of a guest thread and return its result
+	long runThread(FunctionInfo * fn, long arg) {
+		if (!fn->Def || !mRunner) return 0;
+		StackFrame & frame = push(fn);
+		if (fn->Def->getNumParams() > 0) frame.bindDecl(fn->Def->getParamDecl(0), arg);
+		mRunner(this, fn->Def);
+		if (Returnflag) {
+			Returnflag = false;
+		}
+		else {
+			mRetVal = 0;
+			--mDepth;
+		}
+		return mRetVal;
+	}
+
+	/// Guest threads, see Threads.h
+	inline long spawn(FunctionInfo * fn, long arg);
+	inline long join(long handle);
+	inline void barrier(long parties);
+	inline void abortThreads();
+
+	std::unique_lock<std::mutex> lockIO() {
+		if (!mIOLock) return std::unique_lock<std::mutex>();
+		return std::unique_lock<std::mutex>(*mIOLock);
+	}
+
+	/// Finish a call to a guest function: pop the frame if the body fell off
+	/// its end, then hand the return slot to the call expression.
+	void leave(CallExpr * callexpr) {
+		if (Returnflag) {
+			Returnflag = false;
+		}
+		else {
+			mRetVal = 0;
+			--mDepth;
+			if (mProfiler) mProfiler->leave();
+			if (mCounters) mCounters->leave();
+		}
+		top().bindStmt(callexpr, mRetVal);
+	}
+
    void typetrait(UnaryExprOrTypeTraitExpr* type){ /// process sizeof operator
 	   	if(type->getTypeOfArgument()->isCharType()){
-		   	mStack.back().bindStmt(type,sizeof(char));
+		   	top().bindStmt(type,sizeof(char));
 	   	}
 		else{
-		   	mStack.back().bindStmt(type,sizeof(int));
+		   	top().bindStmt(type,sizeof(int));
 	   	}
    	}
 
    void integerliteral(IntegerLiteral* integer){
    		int val=integer->getValue().getSExtValue();
-   		mStack.back().bindStmt(integer,val);
+   		top().bindStmt(integer,val);
    }
    	void array(ArraySubscriptExpr *arrayexpr){
 		Expr *base_expr=arrayexpr->getBase();
@@ -440,55 +1397,58 @@ public:
 		if(base_ptr->getPointeeType()->isIntegerType()) len=sizeof(int);
 		if(base_ptr->getPointeeType()->isPointerType()) len=sizeof(int);
 
-		int base=mStack.back().getStmtVal(base_expr); 
+		long base=top().getStmtVal(base_expr); 
 		Expr *offset_expr=arrayexpr->getIdx();
-		int offset=mStack.back().getStmtVal(offset_expr);
+		long offset=top().getStmtVal(offset_expr);
 
-		mStack.back().bindStmt(arrayexpr,mHeap.Get(base + offset*sizeof(int)));
+		if (mChecked && !check(arrayexpr, provenance(arrayexpr->getBase()), base + offset*sizeof(int))) return;
+		top().bindStmt(arrayexpr,mHeap->Get(base + offset*sizeof(int)));
    	}
    
    	void paren(ParenExpr *paren){  ///process ()
 	   	Expr* expr=paren->getSubExpr();
-	   	long val = mStack.back().getStmtVal(expr);
-	   	mStack.back().bindStmt(paren,val);
+	   	long val = top().getStmtVal(expr);
+	   	top().bindStmt(paren,val);
    	}
 
 
 
-   	void bindDecl(Decl* decl, int val){  /// another implementation of bindDecl, to support the bind of global var
+   	void bindDecl(Decl* decl, long val){  /// another implementation of bindDecl, to support the bind of global var
    		if (VarDecl * vardecl = dyn_cast<VarDecl>(decl)) {
-   			if( !(vardecl->isLocalVarDeclOrParm()) ){
-   				mVarGlobal.back().bindDecl(decl,val);
+   			if( isGlobal(vardecl) ){
+   				*mVarGlobal.lookup(decl) = val;
    			}
    			else{
-   				mStack.back().bindDecl(decl, val);
+   				top().bindDecl(decl, val);
    			}
    		}
    		else{
-   				mStack.back().bindDecl(decl, val);
+   				top().bindDecl(decl, val);
    		}		
    }
 
-	int getDeclVal(Decl* decl){
-		int val;
+	long getDeclVal(Decl* decl){
+		long val;
 		if (VarDecl * vardecl = dyn_cast<VarDecl>(decl)) {
-			if( !(vardecl->isLocalVarDeclOrParm()) ){
-				val=mVarGlobal.back().getDeclVal(decl);
+			if( isGlobal(vardecl) ){
+				assert (mVarGlobal.count(decl));
+				val=*mVarGlobal.lookup(decl);
 			}
 			else{
-				val = mStack.back().getDeclVal(decl);
+				val = top().getDeclVal(decl);
 			}
 		}
 		else{
-			val = mStack.back().getDeclVal(decl);
+			val = top().getDeclVal(decl);
 		} 
 		return val;
 
    	}
 
    	bool getcond(Expr *expr){
-   		return mStack.back().getStmtVal(expr);
+		if (isReturn()) return false;	/// the loop body returned, its frame is gone
+   		return top().getStmtVal(expr);
    }
 };
 
-
+#include "Threads.h"
@@ -0,0 +1,536 @@
+//==--- Lanes.h - One program over many inputs in lockstep ---------------===//
+//===----------------------------------------------------------------------===//
+#include <fstream>
+
+/// GET from the input file of a lane that left the lockstep walk and is
+/// rerun on its own, without prompts like the lanes
+class FileInput : public InputSource {
+	FILE * mFile;
+public:
+	explicit FileInput(FILE * file) : mFile(file) {
+	}
+
+	virtual bool get(int & val) {
+		return mFile && fscanf(mFile, "%d", &val) == 1;
+	}
+};
+
+/// LaneFrame is the StackFrame of LaneEnvironment: every Decl and Stmt has
+/// one value per lane, stored contiguously, so an operation is a loop over
+/// the lanes. Like StackFrame it is pooled and reset by bumping mGen; a key
+/// keeps its place in mValues from one activation to the next.
+class LaneFrame {
+	struct Slot {
+		unsigned Gen;
+		unsigned Index;		/// Lane 0 in mValues
+	};
+	llvm::DenseMap<const void *, Slot> mSlots;	/// Decls and Stmts
+	std::vector<long> mValues;
+	unsigned mGen;
+	unsigned mWidth;
+	FunctionInfo * mFunction;
+public:
+	std::vector<unsigned> Entry;	/// Lanes live at the call, live again after it
+	std::vector<char> Returned;		/// Lanes that ran a return statement
+	std::vector<long> RetVal;		/// Their return values
+
+	explicit LaneFrame(unsigned width) : mSlots(), mValues(), mGen(0), mWidth(width), mFunction(NULL),
+		Entry(), Returned(width), RetVal(width) {
+	}
+
+	void reset(FunctionInfo * function, const std::vector<unsigned> & live) {
+		++mGen;
+		mFunction = function;
+		Entry = live;
+		Returned.assign(mWidth, 0);
+		RetVal.assign(mWidth, 0);
+	}
+
+	FunctionInfo * getFunction() {
+		return mFunction;
+	}
+
+	/// The lanes of key, to be written. Binding may move the lanes of other
+	/// keys, so bind the result of an operation before getting its operands.
+	long * bind(const void * key) {
+		std::pair<llvm::DenseMap<const void *, Slot>::iterator, bool> it = mSlots.insert(std::make_pair(key, Slot()));
+		if (it.second) {
+			it.first->second.Index = mValues.size();
+			mValues.resize(mValues.size() + mWidth);
+		}
+		it.first->second.Gen = mGen;
+		return &mValues[it.first->second.Index];
+	}
+
+	const long * get(const void * key) {
+		llvm::DenseMap<const void *, Slot>::iterator it = mSlots.find(key);
+		assert (it != mSlots.end() && it->second.Gen == mGen);
+		return &mValues[it->second.Index];
+	}
+};
+
+/// LaneEnvironment runs one program over several GET input streams at once,
+/// the lanes, behind the same visitor as Environment. Control flow is shared:
+/// the visitor walks each statement once and every operation is applied to
+/// all lanes. Each lane has a heap of its own, so its addresses and memory
+/// are its own. A condition that diverges masks lanes off: the branch or
+/// loop body runs once for the lanes where it holds, the else branch once
+/// for the others, and the lanes re-converge after the statement (see the
+/// visitor's specializations for LaneEnvironment). A lane that returns is
+/// masked off until its call ends. Values of masked-off lanes may be
+/// computed, but their variables, memory, input and output are untouched.
+///
+/// A lane masked off at a divergent condition waits while the others run.
+/// Every time a condition splits the live lanes, the lanes of the smaller
+/// side (the else side on a tie) take a strike; a lane with more strikes
+/// than the divergence bound is peeled: it leaves the walk for good, and is
+/// rerun from the start as a scalar Environment run afterwards (see getPeeled).
+class LaneEnvironment {
+	unsigned mWidth;
+	std::vector<unsigned> mLanes;			/// Lanes whose input opened
+	std::vector<unsigned> mLive;			/// Lanes the current statement runs for
+	std::vector<FILE *> mInputs;
+	std::vector<std::string> mOutputs;		/// PRINT output, written to <input>.out at the end
+	std::vector<std::string> mNames;		/// Input files
+	unsigned mDivergence;					/// Strikes a lane may take, 0 peels none
+	std::vector<unsigned> mStrikes;
+	std::vector<char> mIsPeeled;
+	std::vector<unsigned> mPeeled;
+	std::vector<unsigned> mRest;			/// Scratch of narrow
+	std::unique_ptr<Heap[]> mHeaps;
+
+	std::vector<LaneFrame> mStack;			/// Frame pool, only mStack[0, mDepth) is live
+	unsigned mDepth;
+
+	/// Lanes of the global vars, created on first use from their initial value
+	llvm::DenseMap<Decl *, long *> mGlobals;
+	std::vector<std::unique_ptr<long[]> > mGlobalLanes;
+
+	/// Linking and function preparation are those of a scalar run
+	Environment mProgram;
+
+	static void unsupported(const char * what) {
+		llvm::errs() << "-lanes does not support " << what << "\n";
+		exit(1);
+	}
+
+	/// Keep the lanes of saved that did not return and were not peeled
+	void keep(const std::vector<unsigned> & saved, const char * returned) {
+		mLive.clear();
+		for (unsigned l : saved)
+			if (!(returned && returned[l]) && !mIsPeeled[l]) mLive.push_back(l);
+	}
+
+	/// A condition split the live lanes into taken and the rest: strike the
+	/// smaller side and peel its lanes past the bound. The larger side stays,
+	/// so the walk never peels its last lane.
+	void strike(const std::vector<unsigned> & taken, const std::vector<unsigned> & rest) {
+		const std::vector<unsigned> & fewer = taken.size() < rest.size() ? taken : rest;
+		for (unsigned l : fewer) {
+			if (++mStrikes[l] <= mDivergence || !mDivergence) continue;
+			mIsPeeled[l] = 1;
+			mPeeled.push_back(l);
+			llvm::errs() << "-lanes: " << mNames[l] << " diverged, rerun on its own\n";
+		}
+	}
+
+	LaneFrame & top() {
+		return mStack[mDepth - 1];
+	}
+
+	LaneFrame & push(FunctionInfo * function) {
+		if (mDepth == mStack.size()) mStack.push_back(LaneFrame(mWidth));
+		LaneFrame & frame = mStack[mDepth++];
+		frame.reset(function, mLive);
+		return frame;
+	}
+
+	void fill(long * lanes, long val) {
+		for (unsigned i = 0; i < mWidth; ++i)
+			lanes[i] = val;
+	}
+
+	/// Write the live lanes of a variable only
+	void fillLive(long * lanes, long val) {
+		for (unsigned l : mLive)
+			lanes[l] = val;
+	}
+	void copyLive(long * lanes, const long * val) {
+		for (unsigned l : mLive)
+			lanes[l] = val[l];
+	}
+
+	/// Copy the lanes of from to key
+	void copy(const void * key, const void * from) {
+		long * out = top().bind(key);
+		const long * in = top().get(from);
+		for (unsigned i = 0; i < mWidth; ++i)
+			out[i] = in[i];
+	}
+
+	static bool isGlobal(Decl * decl) {
+		VarDecl * vardecl = dyn_cast<VarDecl>(decl);
+		return vardecl && Environment::isGlobal(vardecl);
+	}
+
+	long * global(Decl * decl) {
+		VarDecl * vardecl = dyn_cast<VarDecl>(decl);
+		Decl * canonical = vardecl->getCanonicalDecl();
+		long * lanes = mGlobals.lookup(canonical);
+		if (!lanes) {
+			mGlobalLanes.push_back(std::unique_ptr<long[]>(new long[mWidth]));
+			lanes = mGlobalLanes.back().get();
+			fill(lanes, *mProgram.global(vardecl));
+			mGlobals[canonical] = lanes;
+		}
+		return lanes;
+	}
+
+public:
+	typedef void (*Runner)(LaneEnvironment *, FunctionDecl *);
+	typedef std::vector<unsigned> Mask;
+
+	explicit LaneEnvironment(const std::vector<std::string> & inputs) : mWidth(inputs.size()), mLanes(), mLive(), mInputs(),
+		mOutputs(inputs.size()), mNames(inputs), mDivergence(0), mStrikes(inputs.size()), mIsPeeled(inputs.size()),
+		mPeeled(), mRest(), mHeaps(new Heap[inputs.size()]), mStack(), mDepth(0), mGlobals(), mGlobalLanes(), mProgram() {
+		for (unsigned i = 0; i < inputs.size(); ++i) {
+			FILE * in = fopen(inputs[i].c_str(), "r");
+			if (!in) llvm::errs() << "cannot open input " << inputs[i] << "\n";
+			else mLanes.push_back(i);
+			mInputs.push_back(in);
+		}
+		mLive = mLanes;
+	}
+	~LaneEnvironment() {
+		for (unsigned i = 0; i < mInputs.size(); ++i)
+			if (mInputs[i]) fclose(mInputs[i]);
+	}
+
+	/// Lanes have no guest threads
+	void setRunner(Runner) {
+	}
+
+	/// The strikes after which a lane leaves the walk, 0 keeps every lane
+	void setDivergence(unsigned strikes) {
+		mDivergence = strikes;
+	}
+
+	void init(TranslationUnitDecl * unit) {
+		mProgram.link(unit);
+		if (FunctionDecl * entry = mProgram.getEntry()) push(mProgram.prepare(entry));
+	}
+
+	FunctionDecl * getEntry() {
+		return mProgram.getEntry();
+	}
+
+	/// Whether any input opened
+	bool hasLanes() {
+		return !mLanes.empty();
+	}
+
+	/// No lane runs the current statement: every lane returned, or the
+	/// statement is on a path none of them took
+	bool isReturn() {
+		return mLive.empty();
+	}
+	/// Returns are per lane, see ret
+	void setReturn() {
+	}
+
+	/// The lanes live now, to be restored after a branch or loop
+	Mask mask() {
+		return mLive;
+	}
+
+	/// Mask off the live lanes where cond does not hold
+	void narrow(Expr * cond) {
+		if (mLive.empty()) return;
+		const long * val = top().get(cond);
+		mRest.clear();
+		unsigned kept = 0;
+		for (unsigned l : mLive)
+			if (val[l]) mLive[kept++] = l;
+			else mRest.push_back(l);
+		mLive.resize(kept);
+		if (mLive.empty() || mRest.empty()) return;
+		strike(mLive, mRest);
+		kept = 0;
+		for (unsigned l : mLive)
+			if (!mIsPeeled[l]) mLive[kept++] = l;
+		mLive.resize(kept);
+	}
+
+	/// The else branch: the lanes of saved where cond did not hold
+	void otherwise(const Mask & saved, Expr * cond) {
+		LaneFrame & frame = top();
+		keep(saved, &frame.Returned[0]);
+		if (mLive.empty()) return;
+		const long * val = frame.get(cond);
+		unsigned kept = 0;
+		for (unsigned l : mLive)
+			if (!val[l]) mLive[kept++] = l;
+		mLive.resize(kept);
+	}
+
+	/// Re-converge after a branch or loop: the lanes of saved that did not
+	/// return or leave the walk meanwhile
+	void restore(const Mask & saved) {
+		keep(saved, &top().Returned[0]);
+	}
+
+	void binop(BinaryOperator * bop) {
+		Expr * left = bop->getLHS();
+		Expr * right = bop->getRHS();
+
+		if (bop->isAssignmentOp()) {
+			/// Bind both keys before taking any pointer: a bind that adds a
+			/// key may move the lanes of the others
+			DeclRefExpr * declexpr = dyn_cast<DeclRefExpr>(left);
+			Decl * decl = declexpr ? declexpr->getFoundDecl() : NULL;
+			if (decl && !isGlobal(decl)) top().bind(decl);
+			long * out = top().bind(left);
+			long * var = !decl ? NULL : isGlobal(decl) ? global(decl) : top().bind(decl);
+			const long * val = top().get(right);
+			for (unsigned i = 0; i < mWidth; ++i)
+				out[i] = val[i];
+			if (var) copyLive(var, val);
+			val = out;
+			if (ArraySubscriptExpr * array = dyn_cast<ArraySubscriptExpr>(left)) {
+				const long * base = top().get(array->getBase());
+				const long * offset = top().get(array->getIdx());
+				for (unsigned l : mLive)
+					mHeaps[l].Update(base[l] + offset[l] * sizeof(int), val[l]);
+			}
+			if (UnaryOperator * uop = dyn_cast<UnaryOperator>(left)) {
+				if (uop->getOpcode() == UO_Deref) {
+					const long * addr = top().get(uop->getSubExpr());
+					for (unsigned l : mLive)
+						mHeaps[l].Update(addr[l], val[l]);
+				}
+			}
+			return;
+		}
+
+		long * out = top().bind(bop);
+		const long * l = top().get(left);
+		const long * r = top().get(right);
+		switch (bop->getOpcode()) {
+			case BO_Add: for (unsigned i = 0; i < mWidth; ++i) out[i] = Environment::value(bop, l[i] + r[i]); break;
+			case BO_Sub: for (unsigned i = 0; i < mWidth; ++i) out[i] = Environment::value(bop, l[i] - r[i]); break;
+			case BO_Mul: for (unsigned i = 0; i < mWidth; ++i) out[i] = Environment::value(bop, l[i] * r[i]); break;
+			case BO_LT: for (unsigned i = 0; i < mWidth; ++i) out[i] = l[i] < r[i]; break;
+			case BO_GT: for (unsigned i = 0; i < mWidth; ++i) out[i] = l[i] > r[i]; break;
+			case BO_LE: for (unsigned i = 0; i < mWidth; ++i) out[i] = l[i] <= r[i]; break;
+			case BO_GE: for (unsigned i = 0; i < mWidth; ++i) out[i] = l[i] >= r[i]; break;
+			case BO_EQ: for (unsigned i = 0; i < mWidth; ++i) out[i] = l[i] == r[i]; break;
+			case BO_NE: for (unsigned i = 0; i < mWidth; ++i) out[i] = l[i] != r[i]; break;
+			default: break;
+		}
+	}
+
+	void unaryop(UnaryOperator * uop) {
+		long * out = top().bind(uop);
+		const long * val = top().get(uop->getSubExpr());
+		switch (uop->getOpcode()) {
+			case UO_Plus: for (unsigned i = 0; i < mWidth; ++i) out[i] = val[i]; break;
+			case UO_Minus: for (unsigned i = 0; i < mWidth; ++i) out[i] = -val[i]; break;
+			case UO_Deref: for (unsigned l : mLive) out[l] = mHeaps[l].Get(val[l]); break;
+			default: break;
+		}
+	}
+
+	void decl(DeclStmt * declstmt) {
+		for (DeclStmt::decl_iterator it = declstmt->decl_begin(), ie = declstmt->decl_end(); it != ie; ++it) {
+			VarDecl * vardecl = dyn_cast<VarDecl>(*it);
+			if (!vardecl || vardecl->hasExternalStorage()) continue;
+			if (!vardecl->hasInit()) {
+				long * lanes = top().bind(vardecl);
+				fillLive(lanes, 0);
+				if (vardecl->getType()->isArrayType()) {
+					long size = top().getFunction()->ArraySizes.lookup(vardecl);
+					for (unsigned l : mLive)
+						lanes[l] = mHeaps[l].Malloc(size);
+				}
+			}
+			else if (IntegerLiteral * integer = dyn_cast<IntegerLiteral>(vardecl->getInit())) {
+				fillLive(top().bind(vardecl), (int)integer->getValue().getSExtValue());
+			}
+			else {
+				long * out = top().bind(vardecl);
+				copyLive(out, top().get(vardecl->getInit()));
+			}
+		}
+	}
+
+	void declref(DeclRefExpr * declref) {
+		Decl * decl = declref->getFoundDecl();
+		if (isa<FunctionDecl>(decl)) {
+			fill(top().bind(declref), (long)decl);
+			return;
+		}
+		if (isGlobal(decl)) {
+			long * out = top().bind(declref);
+			const long * val = global(decl);
+			for (unsigned i = 0; i < mWidth; ++i)
+				out[i] = val[i];
+			return;
+		}
+		copy(declref, decl);
+	}
+
+	void cast(CastExpr * castexpr) {
+		long * out = top().bind(castexpr);
+		const long * val = top().get(castexpr->getSubExpr());
+		if (castexpr->getType()->isIntegerType())
+			for (unsigned i = 0; i < mWidth; ++i) out[i] = (int)val[i];
+		else
+			for (unsigned i = 0; i < mWidth; ++i) out[i] = val[i];
+	}
+
+	/// GET reads each lane's own input, PRINT appends to its own output
+	FunctionDecl * call(CallExpr * callexpr) {
+		FunctionInfo * callee = mProgram.prepare(callexpr->getDirectCallee());
+		switch (callee->Builtin) {
+			case FunctionInfo::Get: {
+				long * out = top().bind(callexpr);
+				fill(out, 0);
+				for (unsigned l : mLive) {
+					int val = 0;
+					if (mInputs[l] && fscanf(mInputs[l], "%d", &val) == 1) out[l] = val;
+				}
+				return NULL;
+			}
+			case FunctionInfo::Print: {
+				const long * val = top().get(callexpr->getArg(0));
+				for (unsigned l : mLive) {
+					mOutputs[l] += std::to_string((int)val[l]);
+					mOutputs[l] += '\n';
+				}
+				return NULL;
+			}
+			case FunctionInfo::Malloc: {
+				long * out = top().bind(callexpr);
+				const long * size = top().get(callexpr->getArg(0));
+				for (unsigned l : mLive)
+					out[l] = mHeaps[l].Malloc(size[l]);
+				return NULL;
+			}
+			case FunctionInfo::Free: {
+				const long * addr = top().get(callexpr->getArg(0));
+				for (unsigned l : mLive)
+					mHeaps[l].Free(addr[l]);
+				fill(top().bind(callexpr), 0);
+				return NULL;
+			}
+			case FunctionInfo::None:
+				break;
+			default:
+				unsupported(callexpr->getDirectCallee()->getName().str().c_str());
+		}
+
+		FunctionDecl * def = callee->Def;
+		if (!def) {
+			fill(top().bind(callexpr), 0);
+			return NULL;
+		}
+		LaneFrame & frame = push(callee);
+		LaneFrame & caller = mStack[mDepth - 2];
+		auto param = def->param_begin();
+		for (CallExpr::arg_iterator it = callexpr->arg_begin(), ie = callexpr->arg_end(); it != ie; ++it, ++param) {
+			long * out = frame.bind(*param);
+			const long * val = caller.get(*it);
+			for (unsigned i = 0; i < mWidth; ++i)
+				out[i] = val[i];
+		}
+		return def;
+	}
+
+	/// The live lanes return: they keep their value and are masked off
+	/// until the call ends, the others go on with the rest of the body
+	void ret(ReturnStmt * retstmt) {
+		LaneFrame & frame = top();
+		Expr * expr = retstmt->getRetValue();
+		const long * val = expr ? frame.get(expr) : NULL;
+		for (unsigned l : mLive) {
+			frame.Returned[l] = 1;
+			frame.RetVal[l] = val ? val[l] : 0;
+		}
+		mLive.clear();
+	}
+
+	/// End a call: the lanes that fell off the end of the body return 0, and
+	/// the lanes live at the call are live again
+	void leave(CallExpr * callexpr) {
+		LaneFrame & frame = top();
+		--mDepth;
+		keep(frame.Entry, NULL);
+		long * out = top().bind(callexpr);
+		for (unsigned l : mLive)
+			out[l] = frame.Returned[l] ? frame.RetVal[l] : 0;
+	}
+
+	/// Lanes do not plan inlining: every call pushes a frame
+	FunctionInfo * inlined(CallExpr *) {
+		return NULL;
+	}
+	void enterInline(CallExpr *, FunctionInfo *) {
+	}
+	void leaveInline(CallExpr *, Expr *) {
+	}
+
+	void typetrait(UnaryExprOrTypeTraitExpr * type) {
+		fill(top().bind(type), type->getTypeOfArgument()->isCharType() ? sizeof(char) : sizeof(int));
+	}
+
+	void integerliteral(IntegerLiteral * integer) {
+		fill(top().bind(integer), (int)integer->getValue().getSExtValue());
+	}
+
+	void array(ArraySubscriptExpr * arrayexpr) {
+		long * out = top().bind(arrayexpr);
+		const long * base = top().get(arrayexpr->getBase());
+		const long * offset = top().get(arrayexpr->getIdx());
+		for (unsigned l : mLive)
+			out[l] = mHeaps[l].Get(base[l] + offset[l] * sizeof(int));
+	}
+
+	void paren(ParenExpr * paren) {
+		copy(paren, paren->getSubExpr());
+	}
+
+	/// Whether cond holds in any live lane. Branches and loops mask lanes
+	/// instead, so this is only reached through inlining, which lanes do
+	/// not plan.
+	bool getcond(Expr * expr) {
+		if (mLive.empty()) return false;
+		const long * cond = top().get(expr);
+		for (unsigned l : mLive)
+			if (cond[l]) return true;
+		return false;
+	}
+
+	/// The lanes that left the walk, in the order they left
+	const std::vector<unsigned> & getPeeled() {
+		return mPeeled;
+	}
+
+	/// The input of a peeled lane, from the start for its scalar run
+	FILE * restart(unsigned lane) {
+		if (mInputs[lane]) rewind(mInputs[lane]);
+		return mInputs[lane];
+	}
+
+	/// What the scalar run of a peeled lane printed
+	void setOutput(unsigned lane, const std::string & output) {
+		mOutputs[lane] = output;
+	}
+
+	/// Write the output of every lane
+	void finish() {
+		for (unsigned l : mLanes) {
+			std::ofstream out((mNames[l] + ".out").c_str());
+			out << mOutputs[l];
+		}
+	}
+};
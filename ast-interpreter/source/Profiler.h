@@ -0,0 +1,144 @@
+//==--- Profiler.h - Sampling profiler over the guest call stack ---------===//
+//===----------------------------------------------------------------------===//
+#include <signal.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <atomic>
+#include <map>
+#include <ostream>
+#include <sstream>
+
+/// Profiler samples the guest call stack from a SIGPROF timer. The
+/// Environment keeps a shadow stack of (function, current statement) pairs
+/// in fixed arrays, so the signal handler only copies a few words into a
+/// preallocated buffer: no allocation and no locks while the guest runs.
+/// Samples are folded into Brendan Gregg's format when the run is over.
+class Profiler {
+	struct Frame {
+		FunctionDecl * Fn;
+		Stmt * PC;			/// Statement running in this frame, the call site for callers
+	};
+	static const int MaxDepth = 256;
+	Frame mStack[MaxDepth];
+	volatile int mDepth;
+	Stmt * volatile mPC;	/// Statement running in the innermost frame
+
+	/// Samples are [depth, fn, pc, fn, pc, ...] records, outermost frame first
+	const void ** mBuffer;
+	volatile size_t mUsed;
+	size_t mCapacity;
+	volatile unsigned long mDropped;
+	unsigned mHz;
+
+	static Profiler *& active() {
+		static Profiler * profiler = NULL;
+		return profiler;
+	}
+
+	static void handler(int) {
+		if (Profiler * profiler = active()) profiler->sample();
+	}
+
+	void sample() {
+		int depth = mDepth < MaxDepth ? mDepth : MaxDepth;
+		if (depth <= 0) return;
+		size_t used = mUsed;
+		if (used + 2 * depth + 1 > mCapacity) {
+			++mDropped;
+			return;
+		}
+		mBuffer[used++] = (const void *)(long)depth;
+		for (int i = 0; i < depth; ++i) {
+			mBuffer[used++] = mStack[i].Fn;
+			mBuffer[used++] = i == depth - 1 && mDepth <= MaxDepth ? mPC : mStack[i].PC;
+		}
+		mUsed = used;
+	}
+
+	/// "name:line" of a frame in folded output
+	static std::string frame(FunctionDecl * fn, Stmt * pc) {
+		std::ostringstream name;
+		name << fn->getNameAsString();
+		if (pc) {
+			SourceManager & sm = fn->getASTContext().getSourceManager();
+			name << ':' << sm.getSpellingLineNumber(pc->getLocStart());
+		}
+		return name.str();
+	}
+
+public:
+	explicit Profiler(unsigned hz) : mDepth(0), mPC(NULL), mBuffer(NULL), mUsed(0),
+		mCapacity(1 << 22), mDropped(0), mHz(hz ? hz : 99) {
+		mBuffer = new const void *[mCapacity];
+	}
+	~Profiler() {
+		stop();
+		delete [] mBuffer;
+	}
+
+	/// Shadow stack maintenance, called by the Environment
+	void enter(FunctionDecl * fn) {
+		if (mDepth > 0 && mDepth <= MaxDepth) mStack[mDepth - 1].PC = mPC;
+		if (mDepth < MaxDepth) {
+			mStack[mDepth].Fn = fn;
+			mStack[mDepth].PC = NULL;
+		}
+		mPC = NULL;
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+		mDepth = mDepth + 1;
+	}
+	void leave() {
+		mDepth = mDepth - 1;
+		std::atomic_signal_fence(std::memory_order_seq_cst);
+		mPC = mDepth > 0 && mDepth <= MaxDepth ? mStack[mDepth - 1].PC : NULL;
+	}
+	void setPC(Stmt * stmt) {
+		mPC = stmt;
+	}
+
+	/// Start sampling on process CPU time
+	void start() {
+		active() = this;
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = handler;
+		action.sa_flags = SA_RESTART;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGPROF, &action, NULL);
+
+		struct itimerval timer;
+		timer.it_interval.tv_sec = 0;
+		timer.it_interval.tv_usec = 1000000 / mHz;
+		timer.it_value = timer.it_interval;
+		setitimer(ITIMER_PROF, &timer, NULL);
+	}
+
+	void stop() {
+		if (active() != this) return;
+		struct itimerval timer;
+		memset(&timer, 0, sizeof(timer));
+		setitimer(ITIMER_PROF, &timer, NULL);
+		signal(SIGPROF, SIG_IGN);
+		active() = NULL;
+	}
+
+	/// One "main:12;f:4 count" line per distinct stack
+	void write(std::ostream & out) {
+		std::map<std::string, unsigned long> stacks;
+		size_t used = mUsed;
+		for (size_t i = 0; i < used; ) {
+			int depth = (int)(long)mBuffer[i++];
+			std::string stack;
+			for (int d = 0; d < depth; ++d, i += 2) {
+				if (d) stack += ';';
+				stack += frame((FunctionDecl *)mBuffer[i], (Stmt *)mBuffer[i + 1]);
+			}
+			++stacks[stack];
+		}
+		for (std::map<std::string, unsigned long>::iterator it = stacks.begin(), ie = stacks.end(); it != ie; ++it)
+			out << it->first << ' ' << it->second << '\n';
+		if (mDropped)
+			llvm::errs() << "profiler: sample buffer full, " << mDropped << " samples dropped\n";
+	}
+};
@@ -0,0 +1,105 @@
+//==--- ResultCache.h - Whole-run results cached on disk ------------------===//
+//===----------------------------------------------------------------------===//
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/MD5.h"
+
+/// ResultCache stores the output of whole runs in a directory, one file per
+/// run named by the MD5 of the interpreter build, the options, the source
+/// and the GET input stream: a run is deterministic apart from GET, so a hit
+/// is the output the run would print. Entries are "<exit status>\n<output>". The
+/// modification time of an entry is its last use; when the directory grows
+/// past its size bound the least recently used entries go first.
+class ResultCache {
+	std::string mDir;
+	long mCapacity;		/// Bytes
+
+	std::string path(const std::string & key) {
+		return mDir + "/" + key;
+	}
+
+	/// Remove the least recently used entries until the directory fits
+	void evict() {
+		DIR * dir = opendir(mDir.c_str());
+		if (!dir) return;
+		std::vector<std::pair<time_t, std::string> > entries;
+		long total = 0;
+		while (struct dirent * entry = readdir(dir)) {
+			std::string file = path(entry->d_name);
+			struct stat st;
+			if (entry->d_name[0] == '.' || stat(file.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+			total += st.st_size;
+			entries.push_back(std::make_pair(st.st_mtime, file));
+		}
+		closedir(dir);
+		if (total <= mCapacity) return;
+		std::sort(entries.begin(), entries.end());
+		for (unsigned i = 0; i < entries.size() && total > mCapacity; ++i) {
+			struct stat st;
+			if (stat(entries[i].second.c_str(), &st) == 0 && unlink(entries[i].second.c_str()) == 0)
+				total -= st.st_size;
+		}
+	}
+
+public:
+	/// The build of the interpreter: a rebuilt engine never serves the
+	/// results of the one before it
+	static const char * version() {
+		return "ast-interpreter " __DATE__ " " __TIME__;
+	}
+
+	ResultCache(const std::string & dir, long capacity) : mDir(dir), mCapacity(capacity) {
+		mkdir(mDir.c_str(), 0755);
+	}
+
+	static std::string key(const std::string & source, const std::string & input, const std::string & options) {
+		llvm::MD5 hash;
+		hash.update(version());
+		hash.update(llvm::StringRef("", 1));
+		hash.update(options);
+		hash.update(llvm::StringRef("", 1));
+		hash.update(std::to_string(source.size()));
+		hash.update(llvm::StringRef("", 1));
+		hash.update(source);
+		hash.update(input);
+		llvm::MD5::MD5Result result;
+		hash.final(result);
+		llvm::SmallString<32> str;
+		llvm::MD5::stringifyResult(result, str);
+		return str.str().str();
+	}
+
+	/// Look up a run, marking it as used
+	bool get(const std::string & key, int & status, std::string & output) {
+		std::ifstream in(path(key).c_str(), std::ios::binary);
+		if (!(in >> status) || in.get() != '\n') return false;
+		std::ostringstream out;
+		out << in.rdbuf();
+		output = out.str();
+		utime(path(key).c_str(), NULL);
+		return true;
+	}
+
+	/// Store a run; the entry appears under its name complete or not at all
+	void put(const std::string & key, int status, const std::string & output) {
+		std::string tmp = path("." + key + "." + std::to_string(getpid()));
+		{
+			std::ofstream out(tmp.c_str(), std::ios::binary);
+			out << status << '\n' << output;
+			if (!out) {
+				unlink(tmp.c_str());
+				return;
+			}
+		}
+		if (rename(tmp.c_str(), path(key).c_str()) != 0) unlink(tmp.c_str());
+		evict();
+	}
+};
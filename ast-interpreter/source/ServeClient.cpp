@@ -0,0 +1,123 @@
+//==--- ServeClient.cpp - Thin client for ast-interpreter -serve ---------===//
+//===----------------------------------------------------------------------===//
+// Drop-in replacement for the ast-interpreter command line: it sends the
+// source and stdin to a running `ast-interpreter -serve`, prints what the
+// program PRINTs and the compiler's errors, and exits with the status of the
+// run, without paying for LLVM startup or a fresh parse.
+//
+//   ast-interpreter-client [-socket path] "`cat testXX.c`"
+//
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <string>
+
+static bool writeAll(int fd, const char * buf, size_t size) {
+	while (size > 0) {
+		ssize_t n = write(fd, buf, size);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			return false;
+		}
+		buf += n;
+		size -= n;
+	}
+	return true;
+}
+
+/// Print every complete frame at the front of reply, see readRequest in
+/// Server.h. Returns false on a malformed frame.
+static bool takeFrames(std::string & reply, int & status) {
+	size_t newline;
+	while ((newline = reply.find('\n')) != std::string::npos) {
+		char * end;
+		unsigned long size = strtoul(reply.c_str() + 1, &end, 10);
+		if (end != reply.c_str() + newline) return false;
+		if (reply.size() - newline - 1 < size) break;
+		std::string body = reply.substr(newline + 1, size);
+		if (reply[0] == 's') status = atoi(body.c_str());
+		else if (reply[0] == 'o' || reply[0] == 'e') writeAll(STDERR_FILENO, body.data(), body.size());
+		else return false;
+		reply.erase(0, newline + 1 + size);
+	}
+	return true;
+}
+
+int main(int argc, char ** argv) {
+	const char * path = "/tmp/ast-interpreter.sock";
+	int arg = 1;
+	if (argc > 3 && strcmp(argv[1], "-socket") == 0) {
+		path = argv[2];
+		arg = 3;
+	}
+	if (arg >= argc) {
+		fprintf(stderr, "usage: %s [-socket path] <source code>\n", argv[0]);
+		return 1;
+	}
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "cannot connect to %s, is ast-interpreter -serve running?\n", path);
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	std::string source = argv[arg];
+	std::string header = std::to_string(source.size()) + "\n";
+	if (!writeAll(fd, header.data(), header.size()) || !writeAll(fd, source.data(), source.size())) {
+		fprintf(stderr, "lost connection to %s\n", path);
+		return 1;
+	}
+
+	/// Forward stdin as the GET stream and the output and errors in the reply
+	/// to stderr, where the interpreter itself prints, until the server
+	/// closes the connection
+	struct pollfd fds[2];
+	fds[0].fd = fd;
+	fds[0].events = POLLIN;
+	fds[1].fd = STDIN_FILENO;
+	fds[1].events = POLLIN;
+	int nfds = 2;
+	char buf[4096];
+	std::string reply;
+	int status = -1;
+	for (;;) {
+		if (poll(fds, nfds, -1) < 0) {
+			if (errno == EINTR) continue;
+			return 1;
+		}
+		if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			ssize_t n = read(fd, buf, sizeof(buf));
+			if (n <= 0) break;
+			reply.append(buf, n);
+			if (!takeFrames(reply, status)) {
+				fprintf(stderr, "malformed reply from %s\n", path);
+				return 1;
+			}
+		}
+		if (nfds == 2 && (fds[1].revents & (POLLIN | POLLHUP | POLLERR))) {
+			ssize_t n = read(STDIN_FILENO, buf, sizeof(buf));
+			if (n <= 0 || !writeAll(fd, buf, n)) {
+				shutdown(fd, SHUT_WR);
+				nfds = 1;
+			}
+		}
+	}
+	close(fd);
+	if (status < 0) {
+		fprintf(stderr, "lost connection to %s\n", path);
+		return 1;
+	}
+	return status;
+}
@@ -0,0 +1,193 @@
+//==--- Server.h - Serve programs over a local Unix socket ---------------===//
+//===----------------------------------------------------------------------===//
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <list>
+#include <memory>
+
+#include "clang/Frontend/ASTUnit.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Support/MD5.h"
+
+/// The wire format of one request, shared with ast-interpreter-client:
+///   <length of the source>\n<source bytes><GET input stream until EOF>
+/// The reply is a sequence of frames <tag><length>\n<bytes>: 'o' carries
+/// PRINT output and GET prompts, 'e' compiler diagnostics and 's' the exit
+/// status in decimal. The status frame comes last, then the server closes
+/// the connection.
+static bool readRequest(Session * session, std::string & source) {
+	std::string header;
+	if (!session->readLine(header)) return false;
+	return session->readBytes(strtoul(header.c_str(), NULL, 10), source);
+}
+
+static bool writeFrame(Session * session, char tag, const char * ptr, size_t size) {
+	std::string header = tag + std::to_string(size) + "\n";
+	return session->write(header.data(), header.size()) && session->write(ptr, size);
+}
+
+static bool writeFrame(Session * session, char tag, const std::string & text) {
+	return writeFrame(session, tag, text.data(), text.size());
+}
+
+/// The stream a served program PRINTs to: every write goes out right away
+/// as an 'o' frame, so output streams while the program runs. A client
+/// that went away only drops the output, see failed.
+class Reply : public llvm::raw_ostream {
+	Session * mSession;
+	uint64_t mPos;
+
+	virtual void write_impl(const char * ptr, size_t size) {
+		writeFrame(mSession, 'o', ptr, size);
+		mPos += size;
+	}
+	virtual uint64_t current_pos() const {
+		return mPos;
+	}
+
+public:
+	explicit Reply(Session * session) : mSession(session), mPos(0) {
+		SetUnbuffered();
+	}
+	~Reply() {
+		flush();
+	}
+
+	/// Whether the client stopped reading before the program finished
+	bool failed() {
+		flush();
+		return mSession->isBroken();
+	}
+};
+
+/// GET for a served program: prompts like the interactive default, then
+/// waits for the value on the session
+class ReplyInput : public InputSource {
+	Session * mSession;
+	Reply & mReply;
+public:
+	ReplyInput(Session * session, Reply & reply) : mSession(session), mReply(reply) {
+	}
+	virtual bool get(int & val) {
+		mReply << "Please Input an Integer Value : \n";
+		mReply.flush();
+		return mSession->get(val);
+	}
+};
+
+/// Builds the ASTUnit of one source the way buildASTFromCode does, but with
+/// the diagnostics going to a consumer of our own instead of stderr
+class UnitBuilder : public clang::tooling::ToolAction {
+	std::unique_ptr<ASTUnit> mUnit;
+public:
+	virtual bool runInvocation(std::shared_ptr<clang::CompilerInvocation> invocation, clang::FileManager * files,
+			std::shared_ptr<clang::PCHContainerOperations> pch, clang::DiagnosticConsumer * diags) {
+		mUnit = ASTUnit::LoadFromCompilerInvocation(invocation, pch,
+			clang::CompilerInstance::createDiagnostics(&invocation->getDiagnosticOpts(), diags, false), files);
+		return mUnit && !mUnit->getDiagnostics().hasErrorOccurred();
+	}
+
+	/// Parse source as input.cc, like the command line does. Returns NULL
+	/// with the diagnostics in errors if it does not compile.
+	std::unique_ptr<ASTUnit> build(const std::string & source, std::string & errors) {
+		llvm::raw_string_ostream os(errors);
+		llvm::IntrusiveRefCntPtr<clang::DiagnosticOptions> options(new clang::DiagnosticOptions());
+		clang::TextDiagnosticPrinter printer(os, &*options);
+		llvm::IntrusiveRefCntPtr<clang::FileManager> files(new clang::FileManager(clang::FileSystemOptions()));
+		std::vector<std::string> args;
+		args.push_back("ast-interpreter");
+		args.push_back("-fsyntax-only");
+		args.push_back("input.cc");
+		clang::tooling::ToolInvocation invocation(args, this, files.get());
+		invocation.setDiagnosticConsumer(&printer);
+		invocation.mapVirtualFile("input.cc", source);
+		bool ok = invocation.run();
+		os.flush();
+		if (!ok) mUnit.reset();
+		return std::move(mUnit);
+	}
+};
+
+/// UnitCache keeps the most recently used parsed programs, so a program that
+/// is submitted again skips the front end entirely.
+class UnitCache {
+	typedef std::pair<std::string, std::shared_ptr<ASTUnit> > Entry;
+	std::list<Entry> mUnits;	/// Most recently used first
+	unsigned mCapacity;
+public:
+	explicit UnitCache(unsigned capacity) : mUnits(), mCapacity(capacity) {
+	}
+
+	/// The parsed program, or NULL with the compiler's diagnostics in errors
+	std::shared_ptr<ASTUnit> get(const std::string & source, std::string & errors) {
+		llvm::MD5 hash;
+		hash.update(source);
+		llvm::MD5::MD5Result result;
+		hash.final(result);
+		llvm::SmallString<32> key;
+		llvm::MD5::stringifyResult(result, key);
+
+		for (std::list<Entry>::iterator it = mUnits.begin(), ie = mUnits.end(); it != ie; ++it) {
+			if (it->first == key.str()) {
+				mUnits.splice(mUnits.begin(), mUnits, it);
+				return it->second;
+			}
+		}
+
+		std::shared_ptr<ASTUnit> unit(UnitBuilder().build(source, errors).release());
+		if (!unit) return unit;
+		mUnits.push_front(Entry(key.str(), unit));
+		if (mUnits.size() > mCapacity) mUnits.pop_back();
+		return unit;
+	}
+};
+
+/// Server accepts connections on a Unix domain socket and hands each one to
+/// the session loop as a new session.
+class Server : public Pollable {
+	SessionLoop * mLoop;
+	std::string mPath;
+	int mFd;
+	std::function<void (int)> mAccept;
+public:
+	Server(SessionLoop * loop, const std::string & path, std::function<void (int)> accept)
+		: mLoop(loop), mPath(path), mFd(-1), mAccept(accept) {
+	}
+	virtual ~Server() {
+		if (mFd < 0) return;
+		mLoop->forget(mFd);
+		close(mFd);
+		unlink(mPath.c_str());
+	}
+
+	bool listen() {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (mPath.size() >= sizeof(addr.sun_path)) {
+			llvm::errs() << "socket path too long: " << mPath << "\n";
+			return false;
+		}
+		strcpy(addr.sun_path, mPath.c_str());
+
+		unlink(mPath.c_str());
+		mFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (mFd < 0 || bind(mFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || ::listen(mFd, 128) < 0) {
+			llvm::errs() << "cannot listen on " << mPath << "\n";
+			return false;
+		}
+		mLoop->hold();
+		mLoop->watch(mFd, this);
+		return true;
+	}
+
+	virtual void ready() {
+		int fd;
+		while ((fd = accept4(mFd, NULL, NULL, SOCK_CLOEXEC)) >= 0)
+			mAccept(fd);
+		mLoop->watch(mFd, this);
+	}
+};
@@ -0,0 +1,263 @@
+//==--- Session.h - Guest programs suspended on GET ----------------------===//
+//===----------------------------------------------------------------------===//
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+
+#include <deque>
+#include <functional>
+
+/// Anything the SessionLoop polls on
+class Pollable {
+public:
+	virtual ~Pollable() {}
+	/// Called by the loop when the fd became ready
+	virtual void ready() = 0;
+};
+
+class Session;
+
+/// SessionLoop hosts many guest programs on one thread. Each program runs as
+/// a Session on its own coroutine stack. GET suspends the session when its
+/// input has no value buffered, and epoll resumes the session once more input
+/// arrives, so a program waiting for input holds no thread.
+class SessionLoop {
+	int mEpoll;
+	ucontext_t mContext;            /// The loop itself, sessions swap back here
+	std::deque<Session *> mRunnable;
+	unsigned mLive;
+public:
+	SessionLoop() : mEpoll(epoll_create1(EPOLL_CLOEXEC)), mContext(), mRunnable(), mLive(0) {
+	}
+	~SessionLoop() {
+		close(mEpoll);
+	}
+
+	ucontext_t * getContext() {
+		return &mContext;
+	}
+
+	/// Start hosting a session
+	void add(Session * session) {
+		++mLive;
+		schedule(session);
+	}
+
+	/// Keep run() going for a pollable that is not a session, such as a
+	/// listening socket
+	void hold() {
+		++mLive;
+	}
+
+	void schedule(Session * session) {
+		mRunnable.push_back(session);
+	}
+
+	/// Poll fd for input (or room for output) on behalf of p; one-shot, p
+	/// re-arms it if needed
+	void watch(int fd, Pollable * p, uint32_t events = EPOLLIN) {
+		struct epoll_event event;
+		event.events = events | EPOLLONESHOT;
+		event.data.ptr = p;
+		if (epoll_ctl(mEpoll, EPOLL_CTL_MOD, fd, &event) < 0 && errno == ENOENT)
+			epoll_ctl(mEpoll, EPOLL_CTL_ADD, fd, &event);
+	}
+
+	void forget(int fd) {
+		epoll_ctl(mEpoll, EPOLL_CTL_DEL, fd, NULL);
+	}
+
+	/// Run until every session added so far has finished
+	inline void run();
+
+	/// Switch from a session back to the loop
+	inline void suspend(Session * session);
+};
+
+class Session : public InputSource, public Pollable {
+	SessionLoop * mLoop;
+	int mFd;                        /// GET reads from here, non-blocking
+	std::string mPending;           /// Input read but not consumed yet
+	bool mEof;
+	bool mBroken;                   /// A write failed, the peer is gone
+	bool mDone;
+	std::function<void (Session *)> mRun;
+	std::function<void (Session *)> mFinish;
+
+	ucontext_t mContext;
+	char * mStack;
+
+	/// Same reservation as a main thread stack; pages are only committed when
+	/// the interpreter recursion actually reaches them
+	static const size_t StackSize = 8 << 20;
+
+	static void entry(unsigned hi, unsigned lo) {
+		Session * session = (Session *)(((uintptr_t)hi << 32) | (uintptr_t)lo);
+		session->mRun(session);
+		session->mDone = true;
+	}
+
+	/// Parse one integer out of mPending the way scanf("%d") would. Returns
+	/// false if the buffered text may still be the prefix of a number.
+	bool parse(int & val, bool & ok) {
+		size_t i = 0, n = mPending.size();
+		while (i < n && isspace((unsigned char)mPending[i])) ++i;
+		size_t start = i;
+		if (i < n && (mPending[i] == '-' || mPending[i] == '+')) ++i;
+		size_t digits = i;
+		while (i < n && isdigit((unsigned char)mPending[i])) ++i;
+		if (i == n && !mEof) return false;
+		ok = i > digits;
+		if (ok) val = atoi(mPending.substr(start, i - start).c_str());
+		mPending.erase(0, ok ? i : start);
+		return true;
+	}
+
+public:
+	Session(SessionLoop * loop, int fd, std::function<void (Session *)> run)
+		: mLoop(loop), mFd(fd), mPending(), mEof(false), mBroken(false), mDone(false), mRun(run), mFinish(),
+		  mContext(), mStack(NULL) {
+		fcntl(mFd, F_SETFL, fcntl(mFd, F_GETFL) | O_NONBLOCK);
+		mStack = (char *)mmap(NULL, StackSize, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+		getcontext(&mContext);
+		mContext.uc_stack.ss_sp = mStack;
+		mContext.uc_stack.ss_size = StackSize;
+		mContext.uc_link = loop->getContext();
+		uintptr_t self = (uintptr_t)this;
+		makecontext(&mContext, (void (*)())entry, 2, (unsigned)(self >> 32), (unsigned)self);
+	}
+	virtual ~Session() {
+		mLoop->forget(mFd);
+		munmap(mStack, StackSize);
+	}
+
+	ucontext_t * getContext() {
+		return &mContext;
+	}
+
+	int getFd() {
+		return mFd;
+	}
+
+	bool isDone() {
+		return mDone;
+	}
+
+	/// Called by the loop once the session has finished
+	void onFinish(std::function<void (Session *)> finish) {
+		mFinish = finish;
+	}
+
+	void finish() {
+		if (mFinish) mFinish(this);
+	}
+
+	virtual void ready() {
+		mLoop->schedule(this);
+	}
+
+	/// Append more input to mPending, suspending the session until the fd is
+	/// readable. Returns false at the end of the input.
+	bool fill() {
+		char buf[4096];
+		for (;;) {
+			ssize_t n = read(mFd, buf, sizeof(buf));
+			if (n > 0) {
+				mPending.append(buf, n);
+				return true;
+			}
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				mLoop->watch(mFd, this);
+				mLoop->suspend(this);
+			}
+			else if (n == 0 || errno != EINTR) {
+				mEof = true;
+				return false;
+			}
+		}
+	}
+
+	/// GET: take a value from the buffer, suspending until more input arrives
+	virtual bool get(int & val) {
+		for (;;) {
+			bool ok = false;
+			if (parse(val, ok)) return ok;
+			fill();
+		}
+	}
+
+	/// Write all of buf to the fd, suspending the session while the peer is
+	/// not keeping up. Returns false, now and for every later write, once
+	/// the peer has gone away.
+	bool write(const char * buf, size_t size) {
+		while (size > 0 && !mBroken) {
+			ssize_t n = ::write(mFd, buf, size);
+			if (n > 0) {
+				buf += n;
+				size -= n;
+			}
+			else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				mLoop->watch(mFd, this, EPOLLOUT);
+				mLoop->suspend(this);
+			}
+			else if (n == 0 || errno != EINTR) {
+				mBroken = true;
+			}
+		}
+		return !mBroken;
+	}
+
+	bool isBroken() {
+		return mBroken;
+	}
+
+	/// Read up to and excluding the next newline
+	bool readLine(std::string & line) {
+		size_t pos;
+		while ((pos = mPending.find('\n')) == std::string::npos)
+			if (!fill()) return false;
+		line.assign(mPending, 0, pos);
+		mPending.erase(0, pos + 1);
+		return true;
+	}
+
+	/// Read exactly size bytes
+	bool readBytes(size_t size, std::string & out) {
+		while (mPending.size() < size)
+			if (!fill()) return false;
+		out.assign(mPending, 0, size);
+		mPending.erase(0, size);
+		return true;
+	}
+};
+
+void SessionLoop::suspend(Session * session) {
+	swapcontext(session->getContext(), &mContext);
+}
+
+void SessionLoop::run() {
+	struct epoll_event events[64];
+	while (mLive) {
+		while (!mRunnable.empty()) {
+			Session * session = mRunnable.front();
+			mRunnable.pop_front();
+			swapcontext(&mContext, session->getContext());
+			if (session->isDone()) {
+				--mLive;
+				session->finish();
+			}
+		}
+		if (!mLive) break;
+
+		int n = epoll_wait(mEpoll, events, 64, -1);
+		for (int i = 0; i < n; ++i)
+			((Pollable *)events[i].data.ptr)->ready();
+	}
+}
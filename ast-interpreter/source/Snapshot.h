@@ -0,0 +1,66 @@
+//==--- Snapshot.h - Fork the interpreter state once per input ------------===//
+//===----------------------------------------------------------------------===//
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <string>
+#include <vector>
+
+#include "llvm/Support/raw_ostream.h"
+
+/// Snapshot freezes the whole interpreter (frames, globals, guest heap and
+/// the AST itself) at one point of the run and replays the rest of the run
+/// once per input file. Every run is a fork() of the frozen process, so the
+/// state is shared copy-on-write and a run starts at the cost of a page-table
+/// copy instead of a fresh parse and init.
+class Snapshot {
+	std::vector<std::string> mInputs;	/// One input file (GET stream) per run
+	bool mTaken;
+public:
+	enum Point {
+		AfterInit,      /// right after Environment::init, before main runs
+		FirstGet        /// at the first GET, after main's deterministic prologue
+	};
+
+	Snapshot(const std::vector<std::string> & inputs) : mInputs(inputs), mTaken(false) {
+	}
+
+	bool isTaken() {
+		return mTaken;
+	}
+
+	/// Take the snapshot: fork one child per input, each child returns from
+	/// here with stdin redirected to its input and finishes the run. The
+	/// parent runs the children one after another, so their PRINT output
+	/// stays in input order, and never returns.
+	void take() {
+		if (mTaken) return;
+		mTaken = true;
+
+		int status = 0;
+		for (std::vector<std::string>::iterator it = mInputs.begin(), ie = mInputs.end(); it != ie; ++it) {
+			fflush(NULL);
+			llvm::errs().flush();
+			pid_t pid = fork();
+			if (pid < 0) {
+				llvm::errs() << "snapshot: fork failed\n";
+				exit(1);
+			}
+			if (pid == 0) {
+				if (!freopen(it->c_str(), "r", stdin)) {
+					llvm::errs() << "snapshot: cannot open input " << *it << "\n";
+					_exit(1);
+				}
+				return;
+			}
+
+			int child = 0;
+			waitpid(pid, &child, 0);
+			if (!WIFEXITED(child) || WEXITSTATUS(child) != 0) status = 1;
+		}
+		_exit(status);
+	}
+};
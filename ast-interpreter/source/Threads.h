@@ -0,0 +1,119 @@
+//==--- Threads.h - Guest threads on host threads ------------------------===//
+//===----------------------------------------------------------------------===//
+#include <condition_variable>
+#include <thread>
+
+/// GuestThreads runs every SPAWNed guest function on a host thread of its
+/// own. Every guest thread gets an Environment of its own, so its own
+/// frames, while the heap and the globals are those of the program that
+/// spawned it. A guest thread blocked in JOIN or BARRIER holds only its own
+/// host thread, so any number of them can wait for each other.
+class GuestThreads {
+	struct Thread {
+		std::unique_ptr<Environment> Env;
+		std::thread Host;
+		bool Finished;
+		long Result;
+	};
+	std::mutex mLock;
+	std::deque<Thread> mThreads;	/// Handle n is mThreads[n - 1]
+	std::condition_variable mFinished;
+
+	std::condition_variable mBarrier;
+	long mArrived;
+	unsigned long mGeneration;
+	bool mAborted;					/// A thread faulted, barriers no longer wait
+public:
+	std::mutex IO;
+
+	GuestThreads() : mLock(), mThreads(), mFinished(), mBarrier(), mArrived(0), mGeneration(0), mAborted(false), IO() {
+	}
+	/// Join every host thread before the Environments they run on go away.
+	/// A thread may still SPAWN while the earlier ones are joined; the
+	/// deque keeps the handles stable.
+	~GuestThreads() {
+		for (size_t i = 0;; ++i) {
+			std::thread host;
+			{
+				std::lock_guard<std::mutex> guard(mLock);
+				if (i == mThreads.size()) break;
+				host.swap(mThreads[i].Host);
+			}
+			host.join();
+		}
+	}
+
+	long spawn(Environment * env, FunctionInfo * fn, long arg) {
+		std::lock_guard<std::mutex> guard(mLock);
+		mThreads.push_back(Thread());
+		Thread * thread = &mThreads.back();
+		thread->Env.reset(env);
+		thread->Finished = false;
+		thread->Result = 0;
+		thread->Host = std::thread([this, thread, fn, arg]() {
+			long result = thread->Env->runThread(fn, arg);
+			std::lock_guard<std::mutex> guard(mLock);
+			thread->Result = result;
+			thread->Finished = true;
+			mFinished.notify_all();
+		});
+		return mThreads.size();
+	}
+
+	long join(long handle) {
+		std::unique_lock<std::mutex> lock(mLock);
+		if (handle < 1 || handle > (long)mThreads.size()) return 0;
+		Thread & thread = mThreads[handle - 1];
+		mFinished.wait(lock, [&thread]() { return thread.Finished; });
+		return thread.Result;
+	}
+
+	/// Block until parties threads have arrived, then release them all
+	void barrier(long parties) {
+		std::unique_lock<std::mutex> lock(mLock);
+		unsigned long generation = mGeneration;
+		if (mAborted) return;
+		if (++mArrived >= parties) {
+			mArrived = 0;
+			++mGeneration;
+			mBarrier.notify_all();
+			return;
+		}
+		mBarrier.wait(lock, [this, generation]() { return generation != mGeneration || mAborted; });
+	}
+
+	/// Release every thread waiting at a barrier, and any that comes later:
+	/// the threads it waits for may never arrive
+	void abort() {
+		std::lock_guard<std::mutex> guard(mLock);
+		mAborted = true;
+		mBarrier.notify_all();
+	}
+};
+
+Environment::~Environment() {
+	/// Join the guest threads while the heap they use is still alive
+	mOwnThreads.reset();
+}
+
+long Environment::spawn(FunctionInfo * fn, long arg) {
+	if (!mThreads) {
+		mHeap->setThreaded();
+		mOwnThreads.reset(new GuestThreads());
+		mThreads = mOwnThreads.get();
+		mIOLock = &mThreads->IO;
+	}
+	return mThreads->spawn(new Environment(this), fn, arg);
+}
+
+long Environment::join(long handle) {
+	return mThreads ? mThreads->join(handle) : 0;
+}
+
+void Environment::barrier(long parties) {
+	if (mThreads) mThreads->barrier(parties);
+}
+
+void Environment::abortThreads() {
+	mThreads->abort();
+}
@@ -0,0 +1,230 @@
+//==--- Trace.h - Recorded runs for deterministic replay ------------------===//
+//===----------------------------------------------------------------------===//
+#include <fstream>
+#include <mutex>
+#include <sstream>
+
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/raw_ostream.h"
+
+/// Trace is everything a run depends on: the source, the value of every GET
+/// and the result of every MALLOC, in the order they happened, plus the
+/// size and MD5 of what the run printed. The file is
+///
+///   "ASTTRACE" version source-size source output-size output-md5 events
+///
+/// with sizes and values as LEB128 varints (values zigzag encoded) and each
+/// event a tag byte, 'G' value, 'E' for a GET at the end of the input, or
+/// 'M' size address. Recording appends the
+/// events as the run goes; replaying hands back the GET values, checks every
+/// MALLOC against the recorded address and the output against its digest.
+class Trace {
+	static const unsigned Version = 1;
+
+	bool mReplay;
+	std::string mSource;
+	std::string mEvents;
+	size_t mPos;				/// Next event when replaying
+	unsigned long mGets, mMallocs;
+
+	llvm::MD5 mOutput;
+	unsigned long mOutputSize;
+	unsigned long mExpectedSize;
+	std::string mExpectedDigest;
+
+	std::string mError;			/// The first divergence from the recording
+	std::mutex mLock;			/// Guest threads allocate concurrently
+
+	static void putVarint(std::string & out, unsigned long val) {
+		do {
+			unsigned char byte = val & 0x7f;
+			val >>= 7;
+			out += (char)(byte | (val ? 0x80 : 0));
+		} while (val);
+	}
+	static void putSigned(std::string & out, long val) {
+		putVarint(out, ((unsigned long)val << 1) ^ (unsigned long)(val >> 63));
+	}
+
+	bool getVarint(const std::string & in, size_t & pos, unsigned long & val) {
+		val = 0;
+		for (unsigned shift = 0; pos < in.size() && shift < 64; shift += 7) {
+			unsigned char byte = in[pos++];
+			val |= (unsigned long)(byte & 0x7f) << shift;
+			if (!(byte & 0x80)) return true;
+		}
+		return false;
+	}
+	bool getSigned(const std::string & in, size_t & pos, long & val) {
+		unsigned long raw;
+		if (!getVarint(in, pos, raw)) return false;
+		val = (long)(raw >> 1) ^ -(long)(raw & 1);
+		return true;
+	}
+
+	void diverge(const std::string & what) {
+		if (mError.empty())
+			mError = what + " at event " + std::to_string(mGets + mMallocs + 1);
+	}
+
+	std::string digest() {
+		llvm::MD5::MD5Result result;
+		mOutput.final(result);
+		return std::string((const char *)&result[0], 16);
+	}
+
+public:
+	/// Record a run of source
+	explicit Trace(const std::string & source) : mReplay(false), mSource(source), mEvents(), mPos(0),
+		mGets(0), mMallocs(0), mOutput(), mOutputSize(0), mExpectedSize(0), mExpectedDigest(), mError(), mLock() {
+	}
+
+	/// Replay a recorded run, see load
+	Trace() : mReplay(true), mSource(), mEvents(), mPos(0), mGets(0), mMallocs(0),
+		mOutput(), mOutputSize(0), mExpectedSize(0), mExpectedDigest(), mError(), mLock() {
+	}
+
+	bool load(const std::string & path) {
+		std::ifstream in(path.c_str(), std::ios::binary);
+		std::ostringstream data;
+		data << in.rdbuf();
+		std::string file = data.str();
+		size_t pos = 8;
+		unsigned long version, size;
+		if (!in || file.compare(0, 8, "ASTTRACE") != 0) return false;
+		if (!getVarint(file, pos, version) || version != Version) return false;
+		if (!getVarint(file, pos, size) || size > file.size() - pos) return false;
+		mSource = file.substr(pos, size);
+		pos += size;
+		if (!getVarint(file, pos, mExpectedSize) || file.size() - pos < 16) return false;
+		mExpectedDigest = file.substr(pos, 16);
+		mEvents = file.substr(pos + 16);
+		return true;
+	}
+
+	bool write(const std::string & path) {
+		std::string header("ASTTRACE");
+		putVarint(header, Version);
+		putVarint(header, mSource.size());
+		header += mSource;
+		putVarint(header, mOutputSize);
+		header += digest();
+		std::ofstream out(path.c_str(), std::ios::binary);
+		out << header << mEvents;
+		return (bool)out;
+	}
+
+	bool replaying() {
+		return mReplay;
+	}
+
+	const std::string & getSource() {
+		return mSource;
+	}
+
+	/// A GET: recorded, or read back from the recording. read is whether
+	/// the recorded run's input had a value; a GET at the end of the input
+	/// replays as 0 and false.
+	bool get(int & val, bool read) {
+		std::lock_guard<std::mutex> lock(mLock);
+		if (!mReplay) {
+			mEvents += read ? 'G' : 'E';
+			if (read) putSigned(mEvents, val);
+			++mGets;
+			return read;
+		}
+		long recorded;
+		if (mPos >= mEvents.size() || (mEvents[mPos] != 'G' && mEvents[mPos] != 'E')) {
+			diverge("GET where the recording has none");
+			return false;
+		}
+		if (mEvents[mPos++] == 'E') {
+			++mGets;
+			val = 0;
+			return false;
+		}
+		if (!getSigned(mEvents, mPos, recorded)) {
+			diverge("truncated GET");
+			return false;
+		}
+		++mGets;
+		val = recorded;
+		return true;
+	}
+
+	/// A MALLOC of size bytes that returned addr
+	void malloc(long size, long addr) {
+		std::lock_guard<std::mutex> lock(mLock);
+		if (!mReplay) {
+			mEvents += 'M';
+			putSigned(mEvents, size);
+			putVarint(mEvents, addr);
+			++mMallocs;
+			return;
+		}
+		long recordedSize;
+		unsigned long recordedAddr;
+		if (mPos >= mEvents.size() || mEvents[mPos] != 'M') {
+			diverge("MALLOC where the recording has none");
+			return;
+		}
+		++mPos;
+		if (!getSigned(mEvents, mPos, recordedSize) || !getVarint(mEvents, mPos, recordedAddr)) {
+			diverge("truncated MALLOC");
+			return;
+		}
+		if (recordedSize != size || (long)recordedAddr != addr) {
+			std::ostringstream what;
+			what << "MALLOC(" << size << ") returned 0x" << std::hex << addr << ", recorded MALLOC("
+				<< std::dec << recordedSize << ") returned 0x" << std::hex << recordedAddr;
+			diverge(what.str());
+		}
+		++mMallocs;
+	}
+
+	/// Everything PRINT wrote, see TraceOutput
+	void output(const char * ptr, size_t size) {
+		mOutput.update(llvm::StringRef(ptr, size));
+		mOutputSize += size;
+	}
+
+	/// After a replay: whether the run did and printed what was recorded
+	bool verify(llvm::raw_ostream & os) {
+		if (mError.empty() && mPos < mEvents.size())
+			mError = "run ended with " + std::to_string(mEvents.size() - mPos) + " bytes of events left";
+		if (mError.empty() && (mOutputSize != mExpectedSize || digest() != mExpectedDigest))
+			mError = "PRINT output differs (" + std::to_string(mOutputSize) + " bytes, recorded "
+				+ std::to_string(mExpectedSize) + ")";
+		if (!mError.empty()) {
+			os << "replay mismatch: " << mError << "\n";
+			return false;
+		}
+		os << "replay OK: " << mGets << " GETs, " << mMallocs << " MALLOCs, " << mOutputSize << " bytes of output\n";
+		return true;
+	}
+};
+
+/// The stream PRINT writes to while recording or replaying: feeds the
+/// trace's output digest and passes the text on to echo, if any
+class TraceOutput : public llvm::raw_ostream {
+	Trace & mTrace;
+	llvm::raw_ostream * mEcho;
+	uint64_t mPos;
+
+	virtual void write_impl(const char * ptr, size_t size) {
+		mTrace.output(ptr, size);
+		if (mEcho) mEcho->write(ptr, size);
+		mPos += size;
+	}
+	virtual uint64_t current_pos() const {
+		return mPos;
+	}
+
+public:
+	TraceOutput(Trace & trace, llvm::raw_ostream * echo) : mTrace(trace), mEcho(echo), mPos(0) {
+		SetUnbuffered();
+	}
+	~TraceOutput() {
+		flush();
+	}
+};
@@ -0,0 +1,13 @@
+// EXPECT: out-of-bounds range of 8 elements
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+extern int * MEMSET(int *, int, int);
+
+int main() {
+   int* a;
+   a = (int *)MALLOC(sizeof(int)*4);
+   MEMSET(a, 1, 8);
+   PRINT(a[0]);
+}
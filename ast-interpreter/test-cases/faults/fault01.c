@@ -0,0 +1,16 @@
+// EXPECT: out-of-bounds range of 4 elements
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+extern int * MEMCPY(int *, int *, int);
+
+int main() {
+   int* a;
+   int* b;
+   a = (int *)MALLOC(sizeof(int)*4);
+   b = (int *)MALLOC(sizeof(int)*4);
+   MEMCPY(a, b, 4);
+   MEMCPY(a+2, b, 4);
+   PRINT(a[0]);
+}
@@ -0,0 +1,16 @@
+// ARGS: -checked
+// EXPECT: out-of-bounds access to guest address
+extern int GET();
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int main() {
+   int* a;
+   int* b;
+   a = (int *)MALLOC(sizeof(int)*4);
+   b = (int *)MALLOC(sizeof(int)*4);
+   *b = 1;
+   *(a+2048) = 2;
+   PRINT(*b);
+}
@@ -0,0 +1,10 @@
+// ARGS: -link=fault03.c,link/dup.c
+// EXPECT: duplicate definition of 'g'
+extern void PRINT(int);
+
+int g = 1;
+
+int main() {
+   extern int g;
+   PRINT(g);
+}
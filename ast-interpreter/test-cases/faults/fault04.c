@@ -0,0 +1,14 @@
+// ARGS: -checked
+// EXPECT: invalid FREE of guest address
+extern void * MALLOC(int);
+extern void FREE(void *);
+extern void PRINT(int);
+
+int main() {
+   int* a;
+   a = (int *)MALLOC(sizeof(int)*4);
+   a[0] = 1;
+   FREE(a);
+   FREE(a);
+   PRINT(a[0]);
+}
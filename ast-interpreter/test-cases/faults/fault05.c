@@ -0,0 +1,13 @@
+// ARGS: -checked
+// EXPECT: out-of-bounds access to guest address
+extern void * MALLOC(int);
+extern void PRINT(int);
+extern int ATOMIC_ADD(int *, int);
+extern int ATOMIC_CAS(int *, int, int);
+
+int main() {
+   int* a;
+   a = (int *)MALLOC(sizeof(int)*4);
+   PRINT(ATOMIC_CAS(a + 3, 0, 1));
+   PRINT(ATOMIC_ADD(a + 100, 1));
+}
@@ -0,0 +1,5 @@
+int g = 2;
+
+int twice(int x) {
+   return x * 2;
+}
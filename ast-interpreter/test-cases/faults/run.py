@@ -0,0 +1,61 @@
+#!/usr/bin/env python3
+"""Run the guest programs that must fail and check how they fail.
+
+Each program names its expected diagnostic, and optionally extra interpreter
+options, in its leading comments:
+
+    // ARGS: -checked
+    // EXPECT: out-of-bounds access
+
+The run passes when the interpreter exits with a non-zero status and the
+expected text appears on stderr. Programs run from this directory, so -link
+can name their other files (kept under link/) relative to it.
+
+    test-cases/faults/run.py --interpreter build/bin/ast-interpreter
+"""
+import argparse
+import glob
+import os
+import subprocess
+import sys
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+
+
+def directives(source):
+    args, expect = [], None
+    for line in source.splitlines():
+        if line.startswith('// ARGS:'):
+            args = line[len('// ARGS:'):].split()
+        elif line.startswith('// EXPECT:'):
+            expect = line[len('// EXPECT:'):].strip()
+    return args, expect
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('programs', nargs='*',
+                        help='guest programs (default: test-cases/faults/*.c)')
+    parser.add_argument('--interpreter', default='ast-interpreter')
+    args = parser.parse_args()
+
+    failed = False
+    for program in args.programs or sorted(glob.glob(os.path.join(HERE, '*.c'))):
+        with open(program) as f:
+            source = f.read()
+        options, expect = directives(source)
+        proc = subprocess.run([args.interpreter] + options + [source], stdin=subprocess.DEVNULL, cwd=HERE,
+                              stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+        stderr = proc.stderr.decode(errors='replace')
+        ok = proc.returncode != 0 and expect is not None and expect in stderr
+        failed = failed or not ok
+        print('%-12s %s' % (os.path.basename(program), 'ok' if ok else 'FAIL'))
+        if not ok:
+            print('  expected %r and a non-zero status, got status %d:\n%s'
+                  % (expect, proc.returncode, stderr))
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,29 @@
+// PRINTS: 7 7 7 100 5050 17 17 0 -1
+extern void * MALLOC(int);
+extern void PRINT(int);
+extern int * MEMSET(int *, int, int);
+extern int * MEMCPY(int *, int *, int);
+extern int MEMCMP(int *, int *, int);
+extern int SUM_INT(int *, int);
+extern int MAX_INT(int *, int);
+extern int FILL_RANGE(int *, int, int);
+
+int main() {
+   char buf[100];
+   char copy[100];
+   int* a;
+   MEMSET((int *)buf, 7, 100);
+   MEMCPY((int *)copy, (int *)buf, 100);
+   PRINT(copy[0]);
+   PRINT(copy[50]);
+   PRINT(copy[99]);
+   FILL_RANGE((int *)buf, 1, 100);
+   PRINT(buf[99]);
+   PRINT(SUM_INT((int *)buf, 100));
+   a = (int *)MALLOC(sizeof(int)*8);
+   FILL_RANGE(a, 10, 8);
+   PRINT(a[7]);
+   PRINT(MAX_INT(a, 8));
+   PRINT(MEMCMP(a, a, 8));
+   PRINT(MEMCMP(a, a+1, 7));
+}
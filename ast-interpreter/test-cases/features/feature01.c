@@ -0,0 +1,34 @@
+// PRINTS: 200 100 150 1 0 7
+extern void * MALLOC(int);
+extern void PRINT(int);
+extern int SPAWN(int (*)(int), int);
+extern int JOIN(int);
+extern int ATOMIC_ADD(int *, int);
+extern int ATOMIC_CAS(int *, int, int);
+extern void BARRIER(int);
+
+int* counter;
+
+int work(int n) {
+   int i;
+   for (i = 0; i < n; i = i + 1)
+      ATOMIC_ADD(counter, 1);
+   BARRIER(3);
+   return n * 2;
+}
+
+int main() {
+   int a;
+   int b;
+   counter = (int *)MALLOC(sizeof(int));
+   *counter = 0;
+   a = SPAWN(work, 100);
+   b = SPAWN(work, 50);
+   BARRIER(3);
+   PRINT(JOIN(a));
+   PRINT(JOIN(b));
+   PRINT(*counter);
+   PRINT(ATOMIC_CAS(counter, 150, 7));
+   PRINT(ATOMIC_CAS(counter, 150, 8));
+   PRINT(*counter);
+}
@@ -0,0 +1,17 @@
+// PRINTS: 5 6 6
+extern void PRINT(int);
+
+int g = 5;
+
+int bump() {
+   extern int g;
+   g = g + 1;
+   return g;
+}
+
+int main() {
+   extern int g;
+   PRINT(g);
+   PRINT(bump());
+   PRINT(g);
+}
@@ -0,0 +1,33 @@
+// ARGS: -lanes={tmp}/in1.txt,{tmp}/in2.txt,{tmp}/in3.txt -lanes-divergence=2
+// EXPECT: in2.txt diverged, rerun on its own
+// EXPECT-NOT: in1.txt diverged
+// FILE: in1.txt: 6 1 -2 3 -4 5 -6
+// FILE: in2.txt: 6 -1 2 -3 4 -5 6
+// FILE: in3.txt: 6 7 -1 7 -1 7 -1
+// OUTFILE: in1.txt.out: 9 12
+// OUTFILE: in2.txt.out: 12 9
+// OUTFILE: in3.txt.out: 21 3
+extern int GET();
+extern void PRINT(int);
+
+// in2.txt takes the other branch of the if on every value, so it is struck
+// each time and rerun on its own after the third
+int main() {
+   int n;
+   int v;
+   int i;
+   int pos = 0;
+   int neg = 0;
+   n = GET();
+   for (i = 0; i < n; i = i + 1) {
+      v = GET();
+      if (v > 0) {
+         pos = pos + v;
+      } else {
+         neg = neg - v;
+      }
+   }
+   PRINT(pos);
+   PRINT(neg);
+   return 0;
+}
@@ -0,0 +1,30 @@
+// ARGS: -inline-report
+// PRINTS: 9 7 3
+// EXPECT: main:27: sq inlined
+// EXPECT: main:28: pick inlined
+// EXPECT: main:29: find not inlined (return shape)
+extern void PRINT(int);
+
+int sq(int x) {
+   return x * x;
+}
+
+int pick(int a, int b) {
+   if (a > b) return a;
+   return b;
+}
+
+int find(int n) {
+   int i = 0;
+   while (i < 10) {
+      if (i * i >= n) return i;
+      i = i + 1;
+   }
+   return 0;
+}
+
+int main() {
+   PRINT(sq(3));
+   PRINT(pick(2, 7));
+   PRINT(find(9));
+}
@@ -0,0 +1,20 @@
+// ARGS: -gc -gc-threshold=1 -gc-report
+// PRINTS: 99 42
+// EXPECT: gc: reclaimed
+// EXPECT: collections,
+extern void * MALLOC(int);
+extern void PRINT(int);
+
+int main() {
+   int* keep;
+   int* p;
+   int i;
+   keep = (int *)MALLOC(sizeof(int)*4);
+   keep[0] = 42;
+   for (i = 0; i < 100; i = i + 1) {
+      p = (int *)MALLOC(4096);
+      p[0] = i;
+   }
+   PRINT(p[0]);
+   PRINT(keep[0]);
+}
@@ -0,0 +1,18 @@
+// INPUT: 5
+// ARGS: -cache={tmp}/cache
+// PRINTS: 10
+// EXPECT: warning:
+// ARGS: -cache={tmp}/cache
+// PRINTS: 10
+// EXPECT-NOT: warning:
+extern int GET();
+extern void PRINT(int);
+
+// Never called: only here so that a run through the front end warns, and
+// a run served from the cache, which skips the front end, does not
+int f() {
+}
+
+int main() {
+   PRINT(GET() * 2);
+}
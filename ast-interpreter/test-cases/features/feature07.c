@@ -0,0 +1,21 @@
+// INPUT: 3
+// ARGS: -record={tmp}/trace.bin
+// PRINTS: 3 9 0
+// ARGS: -replay={tmp}/trace.bin
+// PRINTS:
+// EXPECT: replay OK: 2 GETs, 1 MALLOCs
+extern int GET();
+extern void * MALLOC(int);
+extern void PRINT(int);
+
+int main() {
+   int n;
+   int* p;
+   n = GET();
+   PRINT(n);
+   p = (int *)MALLOC(sizeof(int)*n);
+   p[0] = n * n;
+   PRINT(p[0]);
+   // Past the end of the input: recorded as such, and 0 again on replay
+   PRINT(GET());
+}
@@ -0,0 +1,118 @@
+#!/usr/bin/env python3
+"""Run the guest programs that exercise interpreter features and check what
+they print.
+
+Each program describes its runs in its leading comments. Every `// ARGS:`
+line starts one more run with those interpreter options; a program without
+one runs once with none. The lines after an ARGS line belong to that run:
+
+    // PRINTS: 1 2 3        the values PRINTed, in order
+    // EXPECT: inlined      text that must appear on stderr
+    // EXPECT-NOT: warning  text that must not
+
+These apply to every run of the program:
+
+    // INPUT: 7 -7          the GET input on stdin
+    // FILE: in1.txt: 5     a file made before the first run, one value a line
+    // OUTFILE: in1.txt.out: 1 5   the values a file holds after the last run
+
+`{tmp}` in ARGS stands for a scratch directory that lives for all runs of
+the program, and FILE and OUTFILE names are relative to it. Every run must
+exit with status 0.
+
+    test-cases/features/run.py --interpreter build/bin/ast-interpreter
+"""
+import argparse
+import glob
+import os
+import re
+import subprocess
+import sys
+import tempfile
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+NUMBER = re.compile(r'^-?\d+$')
+
+
+def values(text):
+    """PRINT output only: drop GET prompts, reports and diagnostics."""
+    return [line.strip() for line in text.splitlines() if NUMBER.match(line.strip())]
+
+
+def directives(source):
+    runs, common = [], {'input': '', 'files': [], 'outfiles': []}
+    for line in source.splitlines():
+        if not line.startswith('// '):
+            continue
+        key, _, value = line[3:].partition(':')
+        value = value.strip()
+        if key == 'ARGS':
+            runs.append({'args': value.split(), 'prints': None, 'expect': [], 'expect_not': []})
+        elif key == 'INPUT':
+            common['input'] = '\n'.join(value.split()) + '\n'
+        elif key in ('FILE', 'OUTFILE'):
+            name, _, content = value.partition(':')
+            common['files' if key == 'FILE' else 'outfiles'].append((name.strip(), content.split()))
+        elif key in ('PRINTS', 'EXPECT', 'EXPECT-NOT'):
+            if not runs:
+                runs.append({'args': [], 'prints': None, 'expect': [], 'expect_not': []})
+            if key == 'PRINTS':
+                runs[-1]['prints'] = value.split()
+            else:
+                runs[-1]['expect' if key == 'EXPECT' else 'expect_not'].append(value)
+    return runs or [{'args': [], 'prints': None, 'expect': [], 'expect_not': []}], common
+
+
+def check(interpreter, source):
+    """The problems with one program, empty if it passed."""
+    runs, common = directives(source)
+    problems = []
+    with tempfile.TemporaryDirectory() as tmp:
+        for name, content in common['files']:
+            with open(os.path.join(tmp, name), 'w') as f:
+                f.write(''.join(value + '\n' for value in content))
+        for number, run in enumerate(runs, 1):
+            args = [arg.replace('{tmp}', tmp) for arg in run['args']]
+            proc = subprocess.run([interpreter] + args + [source], input=common['input'].encode(),
+                                  stdout=subprocess.DEVNULL, stderr=subprocess.PIPE)
+            stderr = proc.stderr.decode(errors='replace')
+            what = 'run %d (%s)' % (number, ' '.join(run['args']) or 'no options')
+            if proc.returncode != 0:
+                problems.append('%s exited with %d:\n%s' % (what, proc.returncode, stderr))
+            if run['prints'] is not None and values(stderr) != run['prints']:
+                problems.append('%s printed %s, expected %s' % (what, values(stderr), run['prints']))
+            for text in run['expect']:
+                if text not in stderr:
+                    problems.append('%s: %r not on stderr:\n%s' % (what, text, stderr))
+            for text in run['expect_not']:
+                if text in stderr:
+                    problems.append('%s: unexpected %r on stderr:\n%s' % (what, text, stderr))
+        for name, expected in common['outfiles']:
+            path = os.path.join(tmp, name)
+            actual = values(open(path).read()) if os.path.exists(path) else None
+            if actual != expected:
+                problems.append('%s holds %s, expected %s' % (name, actual, expected))
+    return problems
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument('programs', nargs='*',
+                        help='guest programs (default: test-cases/features/*.c)')
+    parser.add_argument('--interpreter', default='ast-interpreter')
+    args = parser.parse_args()
+
+    failed = False
+    for program in args.programs or sorted(glob.glob(os.path.join(HERE, '*.c'))):
+        with open(program) as f:
+            problems = check(args.interpreter, f.read())
+        failed = failed or bool(problems)
+        print('%-14s %s' % (os.path.basename(program), 'FAIL' if problems else 'ok'))
+        for problem in problems:
+            print('  ' + problem)
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())